@@ -70,39 +70,48 @@ namespace bsp::can {
 				(prescaler - 1)
 			);
 
-			//Enable the Fifo1 Message Pending Iterrupt for this peripheral
-			ufsel::bit::set(std::ref(can.IER), CAN_IER_FMPIE0);
+			//Enable the Fifo1 Message Pending Iterrupt and Transmit Mailbox Empty Interrupt for this peripheral
+			ufsel::bit::set(std::ref(can.IER), CAN_IER_FMPIE0, CAN_IER_TMEIE);
 
 			//request to enter normal mode
 			bit::clear(std::ref(can.MCR), CAN_MCR_INRQ);
 		}
 	}
 
-	void write_message_for_transmission(bus_info_t const &bus, MessageData const& msg) {
-		CAN_TypeDef *const peripheral = bus.get_peripheral();
+	namespace {
+		void write_message_for_transmission(bus_info_t const &bus, MessageData const& msg) {
+			CAN_TypeDef *const peripheral = bus.get_peripheral();
 
-		using namespace ufsel;
-		assert(has_empty_mailbox(peripheral));
+			using namespace ufsel;
+			assert(has_empty_mailbox(peripheral));
 
-		std::array<std::uint32_t, 2> msg_data {0};
-		std::memcpy(msg_data.data(), &msg.data, msg.length);
+			std::array<std::uint32_t, 2> msg_data {0};
+			std::memcpy(msg_data.data(), &msg.data, msg.length);
 
-		//Get the code of an empty mailbox.
-		std::uint32_t const mailbox_index = ufsel::bit::sliceable_value{peripheral->TSR}[25_to, 24];
-		std::uint32_t const corresponding_bit = ufsel::bit::bit(std::countr_zero(CAN_TSR_TME0) + mailbox_index);
-		assert(ufsel::bit::all_set(peripheral->TSR, corresponding_bit)); //make sure that mailbox is really empty
+			//Get the code of an empty mailbox.
+			std::uint32_t const mailbox_index = ufsel::bit::sliceable_value{peripheral->TSR}[25_to, 24];
+			std::uint32_t const corresponding_bit = ufsel::bit::bit(std::countr_zero(CAN_TSR_TME0) + mailbox_index);
+			assert(ufsel::bit::all_set(peripheral->TSR, corresponding_bit)); //make sure that mailbox is really empty
 
-		auto &mailbox = peripheral->sTxMailBox[mailbox_index];
+			auto &mailbox = peripheral->sTxMailBox[mailbox_index];
 
-		ufsel::bit::modify(std::ref(mailbox.TDTR), CAN_TDT0R_DLC, msg.length); //write the message length
-		if (msg.length > 0) //and lower and higher word of data
-			mailbox.TDLR = msg_data[0];
-		if (msg.length > 4)
-			mailbox.TDHR = msg_data[1];
+			ufsel::bit::modify(std::ref(mailbox.TDTR), CAN_TDT0R_DLC, msg.length); //write the message length
+			if (msg.length > 0) //and lower and higher word of data
+				mailbox.TDLR = msg_data[0];
+			if (msg.length > 4)
+				mailbox.TDHR = msg_data[1];
 
 
-		//setup the identifier and request the transmission.
-		mailbox.TIR = ufsel::bit::bitmask(msg.id << std::countr_zero(CAN_TI0R_STID), CAN_TI0R_TXRQ);
+			//setup the identifier and request the transmission.
+			mailbox.TIR = ufsel::bit::bitmask(msg.id << std::countr_zero(CAN_TI0R_STID), CAN_TI0R_TXRQ);
+		}
+	}
+
+	void write_messages_for_transmission(bus_info_t const &bus, std::span<MessageData const* const> const messages) {
+		assert(messages.size() <= empty_mailbox_count(bus.get_peripheral()));
+		// bxCAN has no common request register, each mailbox is requested by its own TXRQ bit
+		for (MessageData const* const msg : messages)
+			write_message_for_transmission(bus, *msg);
 	}
 
 	void initialize() {
@@ -138,22 +147,27 @@ namespace bsp::can {
 		//Configure filters in mask mode
 		bit::modify(std::ref(CAN1->FM1R), bit::bitmask_of_width(2), 0);
 
-		bit::modify(std::ref(CAN1->FS1R), bit::bitmask_of_width(2), 0b11); //make filters 32bits wide
+		bit::modify(std::ref(CAN1->FS1R), bit::bitmask_of_width(2), 0); //make filters 16bits wide (two id-mask pairs per bank)
 
 		bit::modify(std::ref(CAN1->FFA1R), bit::bitmask_of_width(2), 0); //assign filters to FIFO 0
 
 		//activate filters (they can still be modified, because FINIT flag overrides this)
 		bit::modify(std::ref(CAN1->FA1R), bit::bitmask_of_width(2), 0b11);
 
-		CAN1->sFilterRegister[0].FR1 = CAN1->sFilterRegister[1].FR1 = filter::sharedPrefix << (5 + 16);
-		CAN1->sFilterRegister[0].FR2 = CAN1->sFilterRegister[1].FR2 = filter::mustMatch << (5 + 16);
+		//16bit filter has mask in the upper halfword and identifier in the lower one. STID occupies bits [15:5]
+		constexpr auto mask_filter = [](unsigned prefix) { return filter::mustMatch << (5 + 16) | prefix << 5; };
+		//First pair accepts regular bootloader messages, second one addressless data of the open data stream
+		CAN1->sFilterRegister[0].FR1 = CAN1->sFilterRegister[1].FR1 = mask_filter(filter::sharedPrefix);
+		CAN1->sFilterRegister[0].FR2 = CAN1->sFilterRegister[1].FR2 = mask_filter(filter::streamPrefix);
 
-		//Each CAN peripheral gets only one filter.
+		//Each CAN peripheral gets only one filter bank.
 		bit::modify(std::ref(CAN1->FMR), bit::bitmask_of_width(6), 1, 8);
 		bit::clear(std::ref(CAN1->FMR), CAN_FMR_FINIT);
 
 		NVIC_EnableIRQ(CAN1_RX0_IRQn);
 		NVIC_EnableIRQ(CAN2_RX0_IRQn);
+		NVIC_EnableIRQ(CAN1_TX_IRQn);
+		NVIC_EnableIRQ(CAN2_TX_IRQn);
 
 		//make sure CAN peripherals have snychronized with the bus
 #if CAN1_used
@@ -193,6 +207,19 @@ extern "C" void CAN2_RX0_IRQHandler(void)
 	txReceiveCANMessage(bsp::can::find_bus_info_by_peripheral(CAN2_BASE).candb_bus, id, data.data(), length);
 }
 
+// The transmit interrupt is pending as long as any of the request completed flags is set. Writing one clears them
+extern "C" void CAN1_TX_IRQHandler(void)
+{
+	CAN1->TSR = CAN_TSR_RQCP0 | CAN_TSR_RQCP1 | CAN_TSR_RQCP2;
+	bsp::can::transmit_mailbox_empty(bsp::can::find_bus_info_by_peripheral(CAN1_BASE));
+}
+
+extern "C" void CAN2_TX_IRQHandler(void)
+{
+	CAN2->TSR = CAN_TSR_RQCP0 | CAN_TSR_RQCP1 | CAN_TSR_RQCP2;
+	bsp::can::transmit_mailbox_empty(bsp::can::find_bus_info_by_peripheral(CAN2_BASE));
+}
+
 
 
 #endif
@@ -9,6 +9,10 @@
 #include <ufsel/assert.hpp>
 #include <ufsel/bit.hpp>
 
+#include <array>
+#include <bit>
+#include <span>
+
 namespace bsp::can {
 
 	struct bus_info_t {
@@ -54,12 +58,19 @@ namespace bsp::can {
 		std::array<std::uint32_t, 2> data;
 	};
 
-	void write_message_for_transmission(bus_info_t const& bus, MessageData const& msg);
+	// Writes the given messages to empty mailboxes and requests their transmission.
+	// The number of messages must not exceed the number of empty mailboxes
+	void write_messages_for_transmission(bus_info_t const& bus, std::span<MessageData const* const> messages);
+
+	// Called from the transmit interrupt once a mailbox becomes empty. Implemented by the user of the BSP
+	void transmit_mailbox_empty(bus_info_t const& bus);
 
 	// Data for CAN filter configuration
 	// 11 bits standard IDs. They share prefix 0x62_, the three bits are variable (range 0x620-0x627)
+	// Addressless data of the open data stream uses a second filter with prefix 0x63_ (range 0x630-0x637)
 	namespace filter {
 		constexpr unsigned sharedPrefix = 0x62 << 4;
+		constexpr unsigned streamPrefix = 0x63 << 4;
 		constexpr unsigned mustMatch = ufsel::bit::bitmask_of_width(8) << 3;
 	}
 
@@ -69,6 +80,15 @@ namespace bsp::can {
 		return ufsel::bit::any_set(can->TSR, CAN_TSR_TME);
 	}
 
+	// Number of transmit mailboxes (tx buffers) of a single peripheral
+	constexpr std::size_t tx_mailbox_count = 3;
+
+	//Returns the number of empty mailboxes of the given peripheral.
+	[[nodiscard]]
+	inline std::size_t empty_mailbox_count(CAN_TypeDef const* const can) {
+		return std::popcount(can->TSR & CAN_TSR_TME);
+	}
+
 	void initialize();
 
 
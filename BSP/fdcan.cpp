@@ -6,6 +6,7 @@
 
 #include <Drivers/stm32g4xx.h>
 
+#include <array>
 #include <cstring>
 
 #include <ufsel/bit_operations.hpp>
@@ -104,11 +105,13 @@ namespace bsp::can {
 
 			// Ignore transmitter delay compensation
 
-			// Enable the "not empty" interrupt of RX FIFO 0 and Bus Off status change
-			bit::set(std::ref(can->IE), FDCAN_IE_BOE, FDCAN_IE_RF0NE);
+			// Enable the "not empty" interrupt of RX FIFO 0, Bus Off status change and Transmission completed
+			bit::set(std::ref(can->IE), FDCAN_IE_BOE, FDCAN_IE_RF0NE, FDCAN_IE_TCE);
+			// Transmission completed interrupt is generated for all tx buffers
+			can->TXBTIE = FDCAN_TXBTIE_TIE;
 
 			bit::set(std::ref(can->ILS),
-					// Generate RX FIFO 0 interrupts on interrupt line 0 (default)
+					// Generate RX FIFO 0 and transmission completed interrupts on interrupt line 0 (default)
 					// Generate Protocol errors (such as bus off and warning ) on interrupt line 1
 					FDCAN_ILS_PERR
 			);
@@ -133,29 +136,18 @@ namespace bsp::can {
 
 		void init_filters(FDCAN_GlobalTypeDef * const can) {
 			MessageRAM_TypeDef * const ram = get_message_ram_for_periph(can);
-			constexpr auto has_std_id = [](auto const id) { return IS_STD_ID(id); };
-			constexpr auto has_ext_id = [](auto const id) { return IS_EXT_ID(id); };
 			using namespace ufsel;
-			// Filter initialization
-			std::size_t const rx_ext_id_count = std::ranges::count_if(candb_received_messages, has_ext_id);
-			std::size_t const rx_std_id_count = std::ranges::count_if(candb_received_messages, has_std_id);
-			assert(rx_ext_id_count + rx_std_id_count == std::size(candb_received_messages));
-
-			constexpr int ids_per_filter = 2;
-			// The number of std and ext filters to be activated
-			std::size_t const std_filter_count = (rx_std_id_count + ids_per_filter - 1) / ids_per_filter;
-			std::size_t const ext_filter_count = (rx_ext_id_count + ids_per_filter - 1) / ids_per_filter;
-
-
-			constexpr int max_ext_filters = 8, max_std_filters = 28;
-			static_assert(std::extent_v<decltype(candb_received_messages)> < (max_ext_filters + max_std_filters) * ids_per_filter,
-					"Identifier list filtering method requires more filters than the hardware exposes. Use mask/range filtering!");
-			assert(ext_filter_count <= max_ext_filters);
-			assert(std_filter_count <= max_std_filters);
+			// Filter initialization. Bootloader messages are accepted by standard mask filters, one per ID prefix
+			constexpr std::array std_filter_prefixes {
+				filter::sharedPrefix, // Prefix shared by all bootloader messages
+				filter::streamPrefix, // Addressless data of the open data stream
+			};
+			constexpr int max_std_filters = 28;
+			static_assert(std::size(std_filter_prefixes) <= max_std_filters, "The hardware exposes only 28 standard filters!");
 
 			bit::set(std::ref(can->RXGFC),
-					ext_filter_count << FDCAN_RXGFC_LSE_Pos, // configure the length of extended filter list
-					std_filter_count << FDCAN_RXGFC_LSS_Pos, // configure the length of standard filter list
+					0 << FDCAN_RXGFC_LSE_Pos, // no extended filters are used
+					std::size(std_filter_prefixes) << FDCAN_RXGFC_LSS_Pos, // configure the length of standard filter list
 					// RXFIFO0 operates in blocking mode (default)
 					0b10 << FDCAN_RXGFC_ANFS_Pos,// reject non-matching standard frames
 					0b10 << FDCAN_RXGFC_ANFE_Pos,// reject non-matching extended frames
@@ -163,11 +155,13 @@ namespace bsp::can {
 					FDCAN_RXGFC_RRFE // reject extended remote frames
 			);
 			// Initialize standard filters
-			bit::sliceable_with_deffered_writeback filter(ram->std_filter[0].S0);
-			filter[bit::slice::for_mask(message_RAM::STD_Filter::S0_SFT_Msk)] = 0b10; // Classic filter with mask
-			filter[bit::slice::for_mask(message_RAM::STD_Filter::S0_SFEC_Msk)] = 0b001; // Store to RX FIFO 0 without priority
-			filter[bit::slice::for_mask(message_RAM::STD_Filter::S0_SFID1_Msk)] = filter::sharedPrefix; // Prefix shared by all bootloader messages
-			filter[bit::slice::for_mask(message_RAM::STD_Filter::S0_SFID2_Msk)] = filter::mustMatch; // "Must match mask"
+			for (std::size_t index = 0; index < std::size(std_filter_prefixes); ++index) {
+				bit::sliceable_with_deffered_writeback filter(ram->std_filter[index].S0);
+				filter[bit::slice::for_mask(message_RAM::STD_Filter::S0_SFT_Msk)] = 0b10; // Classic filter with mask
+				filter[bit::slice::for_mask(message_RAM::STD_Filter::S0_SFEC_Msk)] = 0b001; // Store to RX FIFO 0 without priority
+				filter[bit::slice::for_mask(message_RAM::STD_Filter::S0_SFID1_Msk)] = std_filter_prefixes[index];
+				filter[bit::slice::for_mask(message_RAM::STD_Filter::S0_SFID2_Msk)] = filter::mustMatch; // "Must match mask"
+			}
 
 			// Ignore extended filters (bootloader only uses standard IDs)
 		}
@@ -288,49 +282,71 @@ namespace bsp::can {
 		return result;
 	}
 
-	void write_message_for_transmission(bus_info_t const &bus, MessageData const& msg) {
+	namespace {
+		void write_tx_buffer(bus_info_t const &bus, message_RAM::TX_Buffer::element & tx_buffer, MessageData const& msg) {
+			using namespace ufsel;
+			bool const is_extended = IS_EXT_ID(msg.id);
+
+			tx_buffer.T0 = bit::bitmask(
+					msg.id << (is_extended ? std::countr_zero(message_RAM::TX_Buffer::T0_ID_Msk_EXT) : std::countr_zero(message_RAM::TX_Buffer::T0_ID_Msk_STD)),
+					is_extended << std::countr_zero(message_RAM::TX_Buffer::T0_XTD_Msk)
+				);
+			auto const DLC = length_to_DLC(msg.length);
+			assert(DLC.has_value() && "You attempted to transmit a message of unsupported length!");
+			// Frames fitting the classic payload stay classic, so that nodes without CAN FD support can receive them
+			bool const fd_frame = bus.fd_frame && msg.length > CAN_MESSAGE_SIZE;
+			assert((fd_frame || msg.length <= CAN_MESSAGE_SIZE) && "Frames longer than 8 bytes require FD frames enabled for the bus!");
+			tx_buffer.T1 = bit::bitmask(
+					0 << std::countr_zero(message_RAM::TX_Buffer::T1_MM_Msk),// ignore message marker (keep zero)
+					0 << std::countr_zero(message_RAM::TX_Buffer::T1_EFC_Msk),// do not store TX event // TODO support this at least for Ocarina global timing synchronization
+					fd_frame << std::countr_zero(message_RAM::TX_Buffer::T1_FDF_Msk), // normal or FD frame
+					(fd_frame && bus.bitrate_switching) << std::countr_zero(message_RAM::TX_Buffer::T1_BRS_Msk), // bit rate switching
+					DLC.value() << std::countr_zero(message_RAM::TX_Buffer::T1_DLC_Msk)
+				);
+			int const word_count = (msg.length + sizeof(std::uint32_t) - 1) / sizeof(std::uint32_t);
+			// Copy the message data into Message RAM
+			// Cannot use std::copy here since it is strictly necessary to use word accesses
+			// and std::copy had the tendency to fall back to memcpy which resulted in some byte accesses.
+			for (int word = 0; word < word_count; ++word)
+				tx_buffer.data[word] = msg.data[word];
+		}
+	}
+
+	void write_messages_for_transmission(bus_info_t const &bus, std::span<MessageData const* const> const messages) {
 		FDCAN_GlobalTypeDef * const can = bus.get_peripheral();
 		MessageRAM_TypeDef * const ram = get_message_ram_for_periph(can);
 		using namespace ufsel;
-		assert(has_empty_mailbox(can));
-		// Get the write pointer into the reception queue
-		int const write_index = bit::get(can->TXFQS,FDCAN_TXFQS_TFQPI) >> FDCAN_TXFQS_TFQPI_Pos;
-
-		auto & tx_buffer = ram->tx_buffers[write_index];
-		bool const is_extended = IS_EXT_ID(msg.id);
-
-		tx_buffer.T0 = bit::bitmask(
-				msg.id << (is_extended ? std::countr_zero(message_RAM::TX_Buffer::T0_ID_Msk_EXT) : std::countr_zero(message_RAM::TX_Buffer::T0_ID_Msk_STD)),
-				is_extended << std::countr_zero(message_RAM::TX_Buffer::T0_XTD_Msk)
-			);
-		auto const DLC = length_to_DLC(msg.length);
-		assert(DLC.has_value() && "You attempted to transmit a message of unsupported length!");
-		tx_buffer.T1 = bit::bitmask(
-				0 << std::countr_zero(message_RAM::TX_Buffer::T1_MM_Msk),// ignore message marker (keep zero)
-				0 << std::countr_zero(message_RAM::TX_Buffer::T1_EFC_Msk),// do not store TX event // TODO support this at least for Ocarina global timing synchronization
-				bus.fd_frame << std::countr_zero(message_RAM::TX_Buffer::T1_FDF_Msk), // normal or FD frame
-				bus.bitrate_switching  << std::countr_zero(message_RAM::TX_Buffer::T1_BRS_Msk), // bit rate switching
-				DLC.value() << std::countr_zero(message_RAM::TX_Buffer::T1_DLC_Msk)
-			);
-		int const word_count = (msg.length + sizeof(std::uint32_t) - 1) / sizeof(std::uint32_t);
-		// Copy the message data into Message RAM
-		// Cannot use std::copy here since it is strictly necessary to use word accesses
-		// and std::copy had the tendency to fall back to memcpy which resulted in some byte accesses.
-		for (int word = 0; word < word_count; ++word)
-			tx_buffer.data[word] = msg.data[word];
+		assert(messages.size() <= empty_mailbox_count(can));
+		// Get the write pointer into the transmission queue. The put index advances only once the elements
+		// are requested, hence the following free elements are addressed relative to it (the FIFO wraps around)
+		std::uint32_t const put_index = bit::get(can->TXFQS,FDCAN_TXFQS_TFQPI) >> FDCAN_TXFQS_TFQPI_Pos;
+
+		std::uint32_t requests = 0;
+		for (std::size_t i = 0; i < messages.size(); ++i) {
+			std::uint32_t const write_index = (put_index + i) % std::size(ram->tx_buffers);
+			write_tx_buffer(bus, ram->tx_buffers[write_index], *messages[i]);
+			requests |= bit::bit(write_index);
+		}
 
-		// Add request for this TX buffer element
-		can->TXBAR = bit::bit(write_index);
+		// Add requests for all written TX buffer elements at once
+		if (requests)
+			can->TXBAR = requests;
 	}
 
 	void handle_interrupt(bus_info_t const& bus_info) {
 		FDCAN_GlobalTypeDef * const peripheral = bus_info.get_peripheral();
 
-		assert(ufsel::bit::all_set(peripheral->IR, FDCAN_IR_RF0N));
+		// Interrupt flags are cleared by writing one, hence the flags are written directly (not read-modify-write)
+		if (ufsel::bit::all_set(peripheral->IR, FDCAN_IR_TC)) {
+			peripheral->IR = FDCAN_IR_TC; // clear the interrupt flag
+			transmit_mailbox_empty(bus_info);
+		}
 
-		MessageData const msg = read_message(peripheral);
-		ufsel::bit::set(std::ref(peripheral->IR), FDCAN_IR_RF0N); // clear the interrupt flag
-		txReceiveCANMessage(bus_info.candb_bus, msg.id, msg.data.data(), msg.length);
+		if (ufsel::bit::all_set(peripheral->IR, FDCAN_IR_RF0N)) {
+			MessageData const msg = read_message(peripheral);
+			peripheral->IR = FDCAN_IR_RF0N; // clear the interrupt flag
+			txReceiveCANMessage(bus_info.candb_bus, msg.id, msg.data.data(), msg.length);
+		}
 	}
 
 	void handle_bus_off_warning(bus_info_t const& bus_info) {
@@ -16,6 +16,7 @@
 #include <ufsel/bit_operations.hpp>
 #include <array>
 #include <optional>
+#include <span>
 #include <Drivers/stm32g4xx.h>
 
 #include <Bootloader/options.hpp>
@@ -25,8 +26,10 @@ namespace bsp::can {
 
 	// Data for CAN filter configuration
 	// 11 bits standard IDs. They share prefix 0x62_, the three bits are variable (range 0x620-0x627)
+	// Addressless data of the open data stream uses a second filter with prefix 0x63_ (range 0x630-0x637)
 	namespace filter {
 		constexpr unsigned sharedPrefix = 0x62 << 4;
+		constexpr unsigned streamPrefix = 0x63 << 4;
 		constexpr unsigned mustMatch = ufsel::bit::bitmask_of_width(8) << 3;
 	}
 
@@ -37,7 +40,7 @@ namespace bsp::can {
 		std::uintptr_t peripheral_address; // This struct is used in constexpr context, can't use FDCAN_GlobalTypedef* as that involves reinterpret_cast
 		Frequency bitrate_nominal;
 		Frequency bitrate_data;
-		bool fd_frame; // Allow higher DLC and longer frames
+		bool fd_frame; // Allow higher DLC and longer frames (selected per bus by compile.py)
 		bool bitrate_switching; // Enable higher bitrate for data section of CAN frames
 
 		[[nodiscard]]
@@ -53,10 +56,10 @@ namespace bsp::can {
     constexpr std::array bus_info = {
 		// Car CANs, both FD capable.
 #if CAN1_used
-	    bus_info_t {.bus_index = 0, .bus_name = "CAN1", .candb_bus = bus_CAN1, .peripheral_address = CAN1_PERIPHERAL, .bitrate_nominal = CAN1_BITRATE, .bitrate_data = 1'000_kHz, .fd_frame = false, .bitrate_switching = false},
+	    bus_info_t {.bus_index = 0, .bus_name = "CAN1", .candb_bus = bus_CAN1, .peripheral_address = CAN1_PERIPHERAL, .bitrate_nominal = CAN1_BITRATE, .bitrate_data = 1'000_kHz, .fd_frame = CAN1_FD, .bitrate_switching = false},
 #endif
 #if CAN2_used
-	    bus_info_t {.bus_index = 1, .bus_name = "CAN2", .candb_bus = bus_CAN2, .peripheral_address = CAN2_PERIPHERAL, .bitrate_nominal = CAN2_BITRATE, .bitrate_data = 1'000_kHz, .fd_frame = false, .bitrate_switching = false},
+	    bus_info_t {.bus_index = 1, .bus_name = "CAN2", .candb_bus = bus_CAN2, .peripheral_address = CAN2_PERIPHERAL, .bitrate_nominal = CAN2_BITRATE, .bitrate_data = 1'000_kHz, .fd_frame = CAN2_FD, .bitrate_switching = false},
 #endif
 	};
 
@@ -344,7 +347,12 @@ namespace bsp::can {
 
 	void initialize(); //Fully initializes both CAN peripherals using configured clock frequencies.
 
-	void write_message_for_transmission(bus_info_t const& bus, MessageData const& msg);
+	// Writes the given messages to consecutive empty tx buffers and requests their transmission by a single register write.
+	// The number of messages must not exceed the number of empty tx buffers
+	void write_messages_for_transmission(bus_info_t const& bus, std::span<MessageData const* const> messages);
+
+	// Called from the interrupt once a transmission completes (a tx buffer becomes free). Implemented by the user of the BSP
+	void transmit_mailbox_empty(bus_info_t const& bus);
 
 	//Returns true iff the given peripheral has at least one mailbox empty.
 	[[nodiscard]]
@@ -352,6 +360,15 @@ namespace bsp::can {
 		return not ufsel::bit::get(can->TXFQS, FDCAN_TXFQS_TFQF);
 	}
 
+	// Number of transmit mailboxes (tx buffers) of a single peripheral
+	constexpr std::size_t tx_mailbox_count = 3;
+
+	//Returns the number of empty tx buffers of the given peripheral.
+	[[nodiscard]]
+	inline std::size_t empty_mailbox_count(FDCAN_GlobalTypeDef const* const can) {
+		return ufsel::bit::get(can->TXFQS, FDCAN_TXFQS_TFFL) >> FDCAN_TXFQS_TFFL_Pos;
+	}
+
 	[[nodiscard]]
 	inline bool has_empty_mailbox(candb_bus_t bus) {
 		return has_empty_mailbox(peripheral_by_candb_bus(bus));
@@ -6,10 +6,13 @@
  * Copyright (c) 2020 eforce FEE Prague Formula
  */
 #include <algorithm>
+#include <bit>
 
 #include "bootloader.hpp"
 #include "flash.hpp"
 #include "canmanager.hpp"
+#include "crc.hpp"
+#include "stream_position.hpp"
 
 #include <ufsel/assert.hpp>
 #include <ufsel/units.hpp>
@@ -37,22 +40,6 @@ namespace boot {
 
 			return HandshakeResponse::Ok;
 		}
-
-		constexpr std::uint32_t calculate_checksum(std::span<MemoryBlock const> logical_memory_map, bool is_bootloader) {
-			std::uint32_t result = 0;
-			for (auto const& block : logical_memory_map) {
-				for (std::uint32_t address = block.address; address < end(block); address += sizeof(std::uint32_t)) {
-					std::uint32_t data = is_bootloader
-							? bootloader_update_buffer_begin[(address - Flash::bootloaderAddress) / sizeof(std::uint32_t)]
-							: ufsel::bit::access_register(address);
-					while (data) {
-						result += data & std::numeric_limits<std::uint16_t>::max();
-						data >>= std::numeric_limits<std::uint16_t>::digits;
-					}
-				}
-			}
-			return result;
-		}
 	}
 
 	WriteStatus FirmwareDownloader::checkAddressBeforeWrite(std::uint32_t const address, std::uint32_t const data) const {
@@ -113,22 +100,47 @@ namespace boot {
 
 		MemoryBlock const enclosingBlock = Flash::getEnclosingBlock(address);
 
-		std::span const already_erased = erased_pages();
-		if (std::ranges::find(already_erased, enclosingBlock) != end(already_erased))
+		std::span const already_erased = erased_pages(), already_kept = unchanged_pages();
+		if (std::ranges::find(already_erased, enclosingBlock) != end(already_erased) || std::ranges::find(already_kept, enclosingBlock) != end(already_kept))
 			return HandshakeResponse::PageAlreadyErased;
 
-		if (!bootloader_.updatingBootloader()) {
-			std::uint32_t const code = Flash::ErasePage(address);
-			if (!Flash::is_SR_ok(code)) {
-				canManager.SendHandshake(handshake::abort(AbortCode::FlashErase, code));
-				return HandshakeResponse::PageEraseFailed;
+		// The master may send digest of the new page content in advance. Matching page needs neither erase nor data.
+		// Bootloader update has to receive the whole image into RAM, hence it never keeps pages.
+		if (std::optional const digest = bootloader_.argument(0); digest.has_value() && !bootloader_.updatingBootloader()) {
+			if (Crc32::of(enclosingBlock) == *digest) {
+				unchanged_pages_[unchanged_pages_count_++] = enclosingBlock;
+				return HandshakeResponse::PageUnchanged;
 			}
 		}
-		erased_pages_[erased_pages_count_++] = enclosingBlock;
 
+		// Bootloader update erases pages once the whole new bootloader is received, on demand erasure once the download reaches them
+		if (bootloader_.updatingBootloader() || bootloader_.erasingOnDemand()) {
+			erased_pages_[erased_pages_count_++] = enclosingBlock;
+			return HandshakeResponse::Ok;
+		}
+
+		// The erasure runs in the background, the main loop keeps processing CAN. Acknowledged once finished (see update)
+		Flash::StartErasePage(address);
+		page_being_erased_ = enclosingBlock;
 		return HandshakeResponse::Ok;
 	}
 
+	void PhysicalMemoryBlockEraser::update() {
+		if (!page_being_erased_.has_value() || Flash::Busy())
+			return;
+
+		HandshakeResponse response = HandshakeResponse::Ok;
+		if (std::uint32_t const code = Flash::FinishErasePage(); Flash::is_SR_ok(code))
+			erased_pages_[erased_pages_count_++] = *page_being_erased_;
+		else {
+			canManager.SendHandshake(handshake::abort(AbortCode::FlashErase, code));
+			response = HandshakeResponse::PageEraseFailed;
+		}
+
+		canManager.SendHandshakeAck(Register::PhysicalBlockToErase, response, page_being_erased_->address);
+		page_being_erased_.reset();
+	}
+
 	Bootloader::FirmwareData Bootloader::summarizeFirmwareData() const {
 		FirmwareData firmware;
 
@@ -218,7 +230,7 @@ namespace boot {
 
 	void LogicalMemoryMapReceiver::startSubtransaction() {
 		status_ = Status::pending;
-		remaining_bytes_ = bootloader_.updatingBootloader() ? Flash::bootloaderMemorySize : Flash::applicationMemorySize;
+		remaining_bytes_ = bootloader_.expectedAddressSpace() == AddressSpace::BootloaderFlash ? Flash::bootloaderMemorySize : Flash::applicationMemorySize;
 	}
 
 	HandshakeResponse LogicalMemoryMapReceiver::receive(Register reg, Command com, std::uint32_t value) {
@@ -267,7 +279,11 @@ namespace boot {
 				return HandshakeResponse::LogicalBlockCountMismatch;
 
 			if (Flash::addressOrigin(value) != bootloader_.expectedAddressSpace())
-				return bootloader_.updatingBootloader() ? HandshakeResponse::AddressNotInBootloader : HandshakeResponse::AddressNotInFlash;
+				return bootloader_.expectedAddressSpace() == AddressSpace::BootloaderFlash ? HandshakeResponse::AddressNotInBootloader : HandshakeResponse::AddressNotInFlash;
+
+			// Ranges of readout are sent word by word
+			if (bootloader_.readingOut() && value % sizeof(std::uint32_t) != 0)
+				return HandshakeResponse::LogicalBlockNotCoverable;
 
 			if (blocks_received_) { //We have already received at least one block
 				MemoryBlock const& previous = blocks_[blocks_received_ - 1];
@@ -295,6 +311,9 @@ namespace boot {
 			if (value > remaining_bytes_) //the block is too long
 				return HandshakeResponse::LogicalBlockTooLong;
 
+			if (bootloader_.readingOut() && value % sizeof(std::uint32_t) != 0)
+				return HandshakeResponse::LogicalBlockNotCoverable;
+
 			if (!PhysicalMemoryMap::canCover(bootloader_.expectedAddressSpace(), blocks_[blocks_received_]))
 				return HandshakeResponse::LogicalBlockNotCoverable;
 
@@ -338,6 +357,12 @@ namespace boot {
 		}
 	}
 
+	void LogicalMemoryMapTransmitter::startSubtransaction(std::span<MemoryBlock const> const blocks) {
+		status_ = Status::pending;
+		block_count_ = size(blocks);
+		std::ranges::copy(blocks, blocks_.begin());
+	}
+
 	Bootloader_Handshake_t LogicalMemoryMapTransmitter::update() {
 		switch (status_) {
 			case Status::uninitialized:
@@ -379,6 +404,9 @@ namespace boot {
 	}
 
 	HandshakeResponse PhysicalMemoryBlockEraser::receive(Register reg, Command com, std::uint32_t value) {
+		if (page_being_erased_.has_value())
+			return HandshakeResponse::HandshakeNotExpected; // The master must wait for the acknowledgement of erasure
+
 		switch (status_) {
 		case Status::uninitialized:
 			status_ = Status::error;
@@ -409,7 +437,7 @@ namespace boot {
 			return HandshakeResponse::Ok;
 
 		}
-		case Status::waitingForMemoryBlocks:
+		case Status::waitingForMemoryBlocks: {
 			if (reg != Register::PhysicalBlockToErase) //We have to erase at least one page.
 				return HandshakeResponse::HandshakeSequenceError;
 
@@ -425,11 +453,11 @@ namespace boot {
 
 			}
 
-			if (HandshakeResponse const result = tryErasePage(value); result != HandshakeResponse::Ok)
-				return result;
-
-			status_ = Status::receivingMemoryBlocks;
-			return HandshakeResponse::Ok;
+			HandshakeResponse const result = tryErasePage(value);
+			if (result == HandshakeResponse::Ok || result == HandshakeResponse::PageUnchanged)
+				status_ = Status::receivingMemoryBlocks;
+			return result;
+		}
 
 		case Status::receivingMemoryBlocks:
 
@@ -443,18 +471,15 @@ namespace boot {
 
 				Flash::Lock();
 				status_ = Status::done;
-				if (erased_pages_count_ != expectedPageCount_)
+				if (erased_pages_count_ + unchanged_pages_count_ != expectedPageCount_)
 					return HandshakeResponse::ErasedPageCountMismatch;
 				return HandshakeResponse::Ok;
 			}
 
-			if (erased_pages_count_ == expectedPageCount_)
+			if (erased_pages_count_ + unchanged_pages_count_ == expectedPageCount_)
 				return HandshakeResponse::ErasedPageCountMismatch;
 
-			if (HandshakeResponse const result = tryErasePage(value); result != HandshakeResponse::Ok)
-				return result;
-
-			return HandshakeResponse::Ok;
+			return tryErasePage(value);
 
 		case Status::done:
 			status_ = Status::error;
@@ -491,44 +516,42 @@ namespace boot {
 			if (ufsel::bit::all_set(FLASH->CR, FLASH_CR_LOCK))
 				Flash::Unlock();
 			status_ = Status::receivingData;
+			Crc32::reset();
+			skip_unchanged_pages();
 			return HandshakeResponse::Ok;
 
 		case Status::receivingData:
-			return HandshakeResponse::HandshakeNotExpected;
-		case Status::noMoreDataExpected: {
+			if (reg == Register::Command && com == Command::CopyFromOldFirmware) {
+				std::optional const source = bootloader_.argument(0);
+				if (!source.has_value())
+					return HandshakeResponse::HandshakeSequenceError;
+				return copy_from_old_firmware(*source, value);
+			}
 
-			if (reg != Register::Checksum)
-				return HandshakeResponse::HandshakeSequenceError;
+			if (reg == Register::Command && com == Command::SkipErasedData)
+				return skip_erased_data(value);
 
-			std::uint32_t const volatile checksum = calculate_checksum(firmwareBlocks_, bootloader_.updatingBootloader());
-			if (value != checksum)
-				return HandshakeResponse::ChecksumMismatch;
+			if (reg == Register::Command && com == Command::Fill) {
+				std::optional const word = bootloader_.argument(0);
+				if (!word.has_value())
+					return HandshakeResponse::HandshakeSequenceError;
+				return fill(*word, value);
+			}
 
-			status_ = Status::receivedChecksum;
+			if (reg != Register::Command || (com != Command::OpenDataStream && com != Command::OpenCompressedDataStream))
+				return HandshakeResponse::HandshakeNotExpected;
 
-			if (bootloader_.updatingBootloader()) {
-				// Checksum is valid, actually update the flash memory
+			return open_stream(value, com == Command::OpenCompressedDataStream);
 
-				if (ufsel::bit::all_set(FLASH->CR, FLASH_CR_LOCK))
-					Flash::Unlock();
+		case Status::noMoreDataExpected:
+			if (reg == Register::Command && com == Command::RestartFromAddress)
+				return repair_block(value);
 
-				for (MemoryBlock const& page : erasedBlocks_) {
-					std::uint32_t const code = Flash::ErasePage(page.address);
-					if (!Flash::is_SR_ok(code)) {
-						canManager.SendHandshake(handshake::abort(AbortCode::FlashErase, code));
-						return HandshakeResponse::PageEraseFailed;
-					}
-				}
-				Flash::AwaitEndOfErasure();
+			if (reg != Register::Checksum)
+				return HandshakeResponse::HandshakeSequenceError;
 
-				if (transfer_bl_update_buffer() != WriteStatus::Ok) {
-					status_ = Status::error;
-					return HandshakeResponse::BufferTransferFailed;
-				}
-			}
-			return HandshakeResponse::Ok;
+			return receive_checksum(value);
 
-		}
 		case Status::receivedChecksum:
 			if (auto const res = checkMagic(reg, value); res != HandshakeResponse::Ok)
 				return res;
@@ -546,6 +569,106 @@ namespace boot {
 		assert_unreachable();
 	}
 
+	HandshakeResponse FirmwareDownloader::receive_checksum(std::uint32_t const checksum) {
+		if (checksum_block_index_ == end_block_index_)
+			return HandshakeResponse::HandshakeNotExpected; // Corrupted blocks have to be repaired first
+
+		std::size_t const block_index = checksum_block_index_++;
+		corrupted_blocks_[block_index] = checksum != block_checksums_[block_index];
+		if (corrupted_blocks_[block_index])
+			return HandshakeResponse::ChecksumMismatch;
+
+		if (checksum_block_index_ != end_block_index_)
+			return HandshakeResponse::Ok;
+		if (corrupted_blocks_.any())
+			return HandshakeResponse::BlocksPendingRepair;
+
+		status_ = Status::receivedChecksum;
+
+		if (bootloader_.erasingOnDemand())
+			// Pages scheduled for erasure that the new firmware has not reached still hold the old firmware
+			return erase_remaining_pages();
+
+		if (bootloader_.updatingBootloader()) {
+			// Checksum is valid, actually update the flash memory
+
+			if (ufsel::bit::all_set(FLASH->CR, FLASH_CR_LOCK))
+				Flash::Unlock();
+
+			for (MemoryBlock const& page : erasedBlocks_) {
+				std::uint32_t const code = Flash::ErasePage(page.address);
+				if (!Flash::is_SR_ok(code)) {
+					canManager.SendHandshake(handshake::abort(AbortCode::FlashErase, code));
+					return HandshakeResponse::PageEraseFailed;
+				}
+			}
+			Flash::AwaitEndOfErasure();
+
+			if (transfer_bl_update_buffer() != WriteStatus::Ok) {
+				status_ = Status::error;
+				return HandshakeResponse::BufferTransferFailed;
+			}
+		}
+		return HandshakeResponse::Ok;
+	}
+
+	HandshakeResponse FirmwareDownloader::repair_block(std::uint32_t const address) {
+		auto const block = std::ranges::find(firmwareBlocks_, address, &MemoryBlock::address);
+		if (checksum_block_index_ != end_block_index_ || block == end(firmwareBlocks_) || !corrupted_blocks_[block - begin(firmwareBlocks_)])
+			return HandshakeResponse::CommandInvalidInCurrentContext;
+
+		// Copies from the old firmware cannot be repeated, it has already been overwritten
+		if (bootloader_.patchingFirmware())
+			return HandshakeResponse::CommandInvalidInCurrentContext;
+
+		// Pages are erased as a whole, hence all blocks sharing a page with the repaired ones are downloaded again as well
+		std::size_t first = block - begin(firmwareBlocks_), last = first;
+		std::uint32_t range_begin = 0, range_end = 0;
+		for (;;) {
+			range_begin = Flash::makePageAligned(firmwareBlocks_[first].address);
+			range_end = end(Flash::getEnclosingBlock(end(firmwareBlocks_[last]) - 1));
+			if (first > 0 && end(firmwareBlocks_[first - 1]) > range_begin)
+				--first;
+			else if (last + 1 < size(firmwareBlocks_) && firmwareBlocks_[last + 1].address < range_end)
+				++last;
+			else
+				break;
+		}
+
+		// Bootloader update is kept in RAM until all checksums match, there is nothing to erase
+		if (!bootloader_.updatingBootloader()) {
+			for (std::size_t page_index = 0; page_index < size(erasedBlocks_); ++page_index) {
+				MemoryBlock const& page = erasedBlocks_[page_index];
+				if (end(page) <= range_begin || page.address >= range_end)
+					continue;
+
+				std::uint32_t const code = Flash::ErasePage(page.address);
+				if (!Flash::is_SR_ok(code)) {
+					canManager.SendHandshake(handshake::abort(AbortCode::FlashErase, code));
+					return HandshakeResponse::PageEraseFailed;
+				}
+				page_erased_[page_index] = true;
+			}
+			Flash::AwaitEndOfErasure();
+		}
+
+		std::uint32_t repaired_bytes = 0;
+		for (std::size_t index = first; index <= last; ++index)
+			repaired_bytes += firmwareBlocks_[index].length;
+		written_bytes_ = InformationSize::fromBytes(written_bytes_.toBytes() - repaired_bytes);
+
+		current_block_index_ = checksum_block_index_ = first;
+		end_block_index_ = last + 1;
+		blockOffset_ = checksummed_offset_ = 0;
+		stream_open_ = stream_synchronized_ = false;
+		receive_window_.reset();
+		restart_requested_ = false;
+		status_ = Status::receivingData;
+		Crc32::reset();
+		skip_unchanged_pages();
+		return HandshakeResponse::Ok;
+	}
+
 	int FirmwareDownloader::calculate_padding_width(std::uint32_t address, std::uint32_t const data, MemoryBlock const * next_block) {
 		std::uint32_t const data_end_address = address + sizeof(data); //this is the address one past last byte written
 		// The address one past the containing flash native type
@@ -605,9 +728,12 @@ namespace boot {
 				data_t const data = bootloader_update_buffer_begin[word_index];
 
 				schedule_data_write(address, data, is_last_write_in_logical_block);
-				WriteStatus const writeStatus = update_flash_write_buffer();
-				if (is_last_write_in_logical_block)
+				WriteStatus writeStatus = update_flash_write_buffer();
+				if (is_last_write_in_logical_block) {
 					assert(Flash::writeBufferIsEmpty());
+					if (writeStatus == WriteStatus::InsufficientData)
+						writeStatus = Flash::CommitRow();
+				}
 				if (writeStatus != WriteStatus::Ok && writeStatus != WriteStatus::InsufficientData) {
 					__BKPT();
 					return writeStatus;
@@ -641,25 +767,533 @@ namespace boot {
 			return WriteStatus::Ok;
 		}
 		else {
+			if (bootloader_.erasingOnDemand())
+				if (WriteStatus const status = prepare_page(address); status != WriteStatus::Ok)
+					return status;
+
 			MemoryBlock const & current_block = firmwareBlocks_[current_block_index_];
 			bool const is_last_write_in_logical_block = blockOffset_ + sizeof(data)  == current_block.length;
 
+			// While a page is being erased in advance, data wait in the write buffer (unless it runs out of space)
+			if (page_erased_ahead_.has_value() && (is_last_write_in_logical_block || Flash::writeBufferFreeSpace() <= Flash::writeBufferSlotsPerWord))
+				if (WriteStatus const status = finish_erase_ahead(); status != WriteStatus::Ok)
+					return status;
+
 			schedule_data_write(address, data, is_last_write_in_logical_block);
+			if (page_erased_ahead_.has_value())
+				return WriteStatus::Ok;
+
 			WriteStatus const writeStatus = update_flash_write_buffer();
+			if (writeStatus != WriteStatus::InsufficientData || !is_last_write_in_logical_block)
+				return writeStatus;
+
+			// Nothing of the logical block may stay in RAM, the next block may lie arbitrarily far
+			assert(Flash::writeBufferIsEmpty());
+			return Flash::CommitRow();
+		}
+	}
+
+	std::uint64_t ReceiveWindow::missing() const {
+		if (empty())
+			return 0;
+		return (std::bit_floor(received_) - 1) & ~received_;
+	}
+
+	bool ReceiveWindow::retransmission_due() const {
+		return !request_sent_.has_value() || request_sent_->TimeElapsed().toMilliseconds() >= timeout_ms_;
+	}
+
+	void ReceiveWindow::retransmission_requested() {
+		if (request_sent_.has_value()) {
+			// The previous request has been lost as well (or the master is busy). Back off
+			request_repeated_ = true;
+			timeout_ms_ = std::min(2 * timeout_ms_, max_timeout_ms);
+		}
+		request_sent_ = Timestamp::Now();
+	}
+
+	void ReceiveWindow::expected_word_received() {
+		if (!request_sent_.has_value())
+			return;
+
+		// Karn's algorithm - the round trip time of repeated requests is ambiguous, don't measure it
+		if (!request_repeated_) {
+			std::uint32_t const rtt_ms = request_sent_->TimeElapsed().toMilliseconds();
+			smoothed_rtt_ms_ = (7 * smoothed_rtt_ms_ + rtt_ms) / 8;
+		}
+		timeout_ms_ = std::clamp(2 * smoothed_rtt_ms_, min_timeout_ms, max_timeout_ms);
+		request_sent_.reset();
+		request_repeated_ = false;
+	}
+
+	void ReceiveWindow::reset() {
+		received_ = 0;
+		head_ = 0;
+		request_sent_.reset();
+		request_repeated_ = false;
+		smoothed_rtt_ms_ = initial_rtt_ms;
+		timeout_ms_ = 2 * initial_rtt_ms;
+	}
+
+	std::optional<std::size_t> FirmwareDownloader::window_position(std::uint32_t const address) const {
+		auto const position = stream_position(firmwareBlocks_.subspan(current_block_index_), blockOffset_, address, ReceiveWindow::length);
+		// Position zero is the expected write location, it is never staged
+		if (position == 0)
+			return std::nullopt;
+		return position;
+	}
+
+	std::uint32_t FirmwareDownloader::window_address(std::size_t position) const {
+		std::uint32_t offset = blockOffset_;
+		for (std::size_t index = current_block_index_; index < size(firmwareBlocks_); ++index, offset = 0) {
+			MemoryBlock const& block = firmwareBlocks_[index];
+			std::size_t const remaining_words = (block.length - offset) / sizeof(std::uint32_t);
+			if (position < remaining_words)
+				return block.address + offset + position * sizeof(std::uint32_t);
+			position -= remaining_words;
+		}
+		assert_unreachable();
+	}
+
+	WriteStatus FirmwareDownloader::check_and_write(std::uint32_t const address, std::uint32_t const data) {
+		WriteStatus write_status = write_word(address, data);
+
+		if (write_status == WriteStatus::DiscontinuousWriteAccess) {
+			// Some preceding words got lost. Keep this one, if it fits in the receive window
+			if (auto const position = window_position(address); position.has_value()) {
+				receive_window_.stage(*position, data);
+				return WriteStatus::Staged;
+			}
+			return write_status;
+		}
+
+		if (write_status != WriteStatus::Ok && write_status != WriteStatus::InsufficientData)
+			return write_status;
+
+		// Addressed write at the expected location resynchronizes the data stream
+		synchronize_stream();
+		receive_window_.expected_word_received();
+
+		// Flush words that were received out of order and are now contiguous with the written data
+		while (data_expected() && receive_window_.has_expected_word()) {
+			write_status = write_word(expectedWriteLocation(), receive_window_.expected_word());
+			if (write_status != WriteStatus::Ok && write_status != WriteStatus::InsufficientData)
+				break;
+		}
+		return write_status;
+	}
+
+	std::uint16_t FirmwareDownloader::receive_credit() {
+		// Classic Data is the least efficient carrier - single word occupies message header and eight bytes of the receive buffer
+		constexpr std::size_t worst_case_bytes_per_word = sizeof(CAN_msg_header) + CAN_MESSAGE_SIZE;
+		std::size_t const credit = std::min(txRecvBufferFreeSpace() / worst_case_bytes_per_word, Flash::writeBufferFreeSpace() / Flash::writeBufferSlotsPerWord);
+		return std::min<std::size_t>(credit, std::numeric_limits<std::uint16_t>::max());
+	}
+
+	void FirmwareDownloader::advertise_credit() {
+		if (!credit_timer_.RestartIfTimeElapsed(credit_period))
+			return;
+
+		// Nothing has been written yet, acknowledge the word preceding the firmware
+		std::uint32_t const location = current_block_index_ == 0 && blockOffset_ == 0 ? firmwareBlocks_.front().address - sizeof(std::uint32_t) : lastWriteLocation();
+		std::uint16_t const credit = receive_credit();
+
+		// Keep quiet unless something changed. Repeat occasionally in case the acknowledgement got lost
+		if (location == acknowledged_location_ && credit == advertised_credit_ && !credit_keepalive_timer_.TimeElapsed(credit_keepalive_period))
+			return;
+
+		canManager.SendDataAck(location, WriteStatus::Ok, credit);
+		credit_keepalive_timer_.Restart();
+		acknowledged_location_ = location;
+		advertised_credit_ = credit;
+	}
+
+	void FirmwareDownloader::update() {
+		if (!data_expected())
+			return;
+
+		advertise_credit();
+		erase_ahead();
+
+		if ((!restart_requested_ && receive_window_.empty()) || !receive_window_.retransmission_due())
+			return;
+
+		std::uint64_t const missing = receive_window_.missing();
+		if (restart_requested_ || std::popcount(missing) > ReceiveWindow::max_retransmitted_words)
+			canManager.RestartDataFrom(expectedWriteLocation());
+		else
+			// Single negative acknowledgement lists all missing words within reach of its bitmap
+			for (std::uint64_t bitmap = missing; bitmap;) {
+				int const first = std::countr_zero(bitmap);
+				std::uint32_t const following = bitmap >> (first + 1) & ufsel::bit::bitmask_of_width(retransmit::bitmap_width);
+				canManager.RetransmitWords(window_address(first), following);
+				bitmap &= ~(std::uint64_t{following} << (first + 1) | std::uint64_t{1} << first);
+			}
+
+		receive_window_.retransmission_requested();
+		restart_requested_ = false;
+	}
+
+	void FirmwareDownloader::checksum_committed_words() {
+		MemoryBlock const& block = firmwareBlocks_[current_block_index_];
+		std::uint32_t frontier = block.address + blockOffset_;
+		if (bootloader_.updatingBootloader()) {
+			for (; checksummed_offset_ < blockOffset_; checksummed_offset_ += sizeof(std::uint32_t))
+				Crc32::update(bootloader_update_buffer_begin[(block.address + checksummed_offset_ - Flash::bootloaderAddress) / sizeof(std::uint32_t)]);
+			return;
+		}
+
+		// Reading the flash would stall until the page erased in the background is done. Catch up later
+		if (page_erased_ahead_.has_value() && Flash::Busy())
+			return;
+
+		if (std::optional const pending = Flash::firstPendingWrite(); pending.has_value())
+			frontier = std::min(frontier, *pending);
+		for (; block.address + checksummed_offset_ < frontier; checksummed_offset_ += sizeof(std::uint32_t))
+			Crc32::update(ufsel::bit::access_register<std::uint32_t>(block.address + checksummed_offset_));
+	}
+
+	void FirmwareDownloader::finish_block() {
+		// All words of the block must reach the flash before its checksum can be completed
+		if (!bootloader_.updatingBootloader())
+			if (WriteStatus const status = flush_writes(); status != WriteStatus::Ok && status != WriteStatus::InsufficientData) {
+				canManager.SendHandshake(handshake::abort(AbortCode::FlashWrite, static_cast<int>(status)));
+				status_ = Status::error;
+				return;
+			}
 
-			if (is_last_write_in_logical_block)
-				assert(Flash::writeBufferIsEmpty());
-			return writeStatus;
+		checksum_committed_words();
+		assert(checksummed_offset_ == blockOffset_);
+		block_checksums_[current_block_index_] = Crc32::value();
+		Crc32::reset();
+		blockOffset_ = checksummed_offset_ = 0;
+		if (++current_block_index_ == end_block_index_)
+			finish_data();
+	}
+
+	void FirmwareDownloader::finish_data() {
+		status_ = Status::noMoreDataExpected;
+		// Sent from here regardless of whether the last word came in Data or the block end was reached by skipping
+		canManager.SendDataAck(lastWriteLocation(), WriteStatus::Ok);
+	}
+
+	void FirmwareDownloader::skip_unchanged_pages() {
+		while (data_expected()) {
+			auto const page = std::ranges::find(unchangedBlocks_, Flash::getEnclosingBlock(expectedWriteLocation()));
+			if (page == end(unchangedBlocks_))
+				return;
+
+			do
+				advance_write_location(); // Unchanged content is part of the checksum
+			while (data_expected() && expectedWriteLocation() >= page->address && expectedWriteLocation() < end(*page));
 		}
 	}
 
+	WriteStatus FirmwareDownloader::erase_page_on_demand(std::size_t const page_index) {
+		if (WriteStatus const status = finish_erase_ahead(); status != WriteStatus::Ok)
+			return status;
+		if (page_erased_[page_index])
+			return WriteStatus::Ok; // It was the page erased in advance
+
+		std::uint32_t const code = Flash::ErasePage(erasedBlocks_[page_index].address);
+		if (!Flash::is_SR_ok(code)) {
+			canManager.SendHandshake(handshake::abort(AbortCode::FlashErase, code));
+			return WriteStatus::OtherError;
+		}
+		page_erased_[page_index] = true;
+		return WriteStatus::Ok;
+	}
+
+	WriteStatus FirmwareDownloader::prepare_page(std::uint32_t const address) {
+		auto const page = std::ranges::find(erasedBlocks_, Flash::getEnclosingBlock(address));
+		assert(page != end(erasedBlocks_)); // Guaranteed by checkAddressBeforeWrite
+		std::size_t const page_index = page - begin(erasedBlocks_);
+		if (page_erased_[page_index])
+			return WriteStatus::Ok;
+
+		if (bootloader_.patchingFirmware()) {
+			// Keep the old content of this page for copy operations (if it fits). Older scratch content is discarded,
+			// the new firmware has already been written over it
+			std::size_t const scratch_words = bootloader_update_buffer_end - bootloader_update_buffer_begin;
+			if (page->length <= scratch_words * sizeof(std::uint32_t)) {
+				for (std::uint32_t offset = 0; offset < page->length; offset += sizeof(std::uint32_t))
+					bootloader_update_buffer_begin[offset / sizeof(std::uint32_t)] = ufsel::bit::access_register(page->address + offset);
+				scratch_page_ = *page;
+			}
+			else
+				scratch_page_.reset();
+		}
+
+		return erase_page_on_demand(page_index);
+	}
+
+	WriteStatus FirmwareDownloader::flush_writes() {
+		if (WriteStatus const status = finish_erase_ahead(); status != WriteStatus::Ok)
+			return status;
+		if (WriteStatus const status = update_flash_write_buffer(); status != WriteStatus::InsufficientData)
+			return status;
+		return Flash::CommitRow();
+	}
+
+	WriteStatus FirmwareDownloader::finish_erase_ahead() {
+		if (!page_erased_ahead_.has_value())
+			return WriteStatus::Ok;
+
+		Flash::AwaitEndOfOperation();
+		std::uint32_t const code = Flash::FinishErasePage();
+		std::size_t const page_index = *page_erased_ahead_;
+		page_erased_ahead_.reset();
+		if (!Flash::is_SR_ok(code)) {
+			canManager.SendHandshake(handshake::abort(AbortCode::FlashErase, code));
+			return WriteStatus::OtherError;
+		}
+		page_erased_[page_index] = true;
+		return WriteStatus::Ok;
+	}
+
+	void FirmwareDownloader::erase_ahead() {
+		if (page_erased_ahead_.has_value()) {
+			if (Flash::Busy())
+				return;
+
+			// Program the data that have been waiting in the write buffer during the erasure
+			WriteStatus write_status = finish_erase_ahead();
+			if (write_status == WriteStatus::Ok)
+				write_status = update_flash_write_buffer();
+			if (write_status != WriteStatus::Ok && write_status != WriteStatus::InsufficientData) {
+				canManager.SendHandshake(handshake::abort(AbortCode::FlashWrite, static_cast<int>(write_status)));
+				status_ = Status::error;
+			}
+			return;
+		}
+
+		// Delta update may still copy from pages ahead of the write location, those must stay intact
+		if (!bootloader_.erasingOnDemand() || bootloader_.patchingFirmware())
+			return;
+
+		// Erase the page being written or the following one in the background. Received data are kept
+		// in the flash write buffer meanwhile (its free space limits the credit advertised to the master)
+		std::uint32_t const location = expectedWriteLocation();
+		std::uint32_t const horizon = end(Flash::getEnclosingBlock(location));
+		for (std::size_t page_index = 0; page_index < size(erasedBlocks_); ++page_index)
+			if (!page_erased_[page_index] && end(erasedBlocks_[page_index]) > location && erasedBlocks_[page_index].address <= horizon) {
+				Flash::StartErasePage(erasedBlocks_[page_index].address);
+				page_erased_ahead_ = page_index;
+				return;
+			}
+	}
+
+	std::optional<std::uint32_t> FirmwareDownloader::read_old_word(std::uint32_t const address) const {
+		if (scratch_page_.has_value() && address >= scratch_page_->address && address < end(*scratch_page_))
+			return bootloader_update_buffer_begin[(address - scratch_page_->address) / sizeof(std::uint32_t)];
+
+		auto const page = std::ranges::find(erasedBlocks_, Flash::getEnclosingBlock(address));
+		if (page != end(erasedBlocks_) && page_erased_[page - begin(erasedBlocks_)])
+			return std::nullopt; // Already overwritten by the new firmware
+
+		return ufsel::bit::access_register(address);
+	}
+
+	HandshakeResponse FirmwareDownloader::copy_from_old_firmware(std::uint32_t const source, std::uint32_t const length) {
+		if (!bootloader_.patchingFirmware())
+			return HandshakeResponse::CommandInvalidInCurrentContext;
+
+		if (length == 0)
+			return HandshakeResponse::MustBeNonZero;
+
+		if (source % sizeof(std::uint32_t) != 0 || length % sizeof(std::uint32_t) != 0 || !bootloader_.oldFirmwareContains(source, length))
+			return HandshakeResponse::PatchSourceInvalid;
+
+		for (std::uint32_t offset = 0; offset < length; offset += sizeof(std::uint32_t)) {
+			if (!data_expected())
+				return HandshakeResponse::BinaryTooBig;
+
+			std::optional const word = read_old_word(source + offset);
+			if (!word.has_value())
+				return HandshakeResponse::PatchSourceInvalid;
+
+			WriteStatus const write_status = write_word(expectedWriteLocation(), *word);
+			if (write_status != WriteStatus::Ok && write_status != WriteStatus::InsufficientData) {
+				canManager.SendHandshake(handshake::abort(AbortCode::FlashWrite, static_cast<int>(write_status)));
+				status_ = Status::error;
+				return HandshakeResponse::InternalStateMachineError;
+			}
+		}
+		return HandshakeResponse::Ok;
+	}
+
+	HandshakeResponse FirmwareDownloader::fill(std::uint32_t const word, std::uint32_t const count) {
+		if (count == 0)
+			return HandshakeResponse::MustBeNonZero;
+
+		for (std::uint32_t written = 0; written < count; ++written) {
+			if (!data_expected())
+				return HandshakeResponse::BinaryTooBig;
+
+			// The same checks as for Data apply to every word
+			switch (WriteStatus const write_status = write_word(expectedWriteLocation(), word)) {
+			case WriteStatus::Ok:
+			case WriteStatus::InsufficientData:
+				break;
+			case WriteStatus::NotInErasedMemory:
+			case WriteStatus::MemoryProtected:
+			case WriteStatus::NotInFlash:
+				return HandshakeResponse::CommandInvalidInCurrentContext;
+			default:
+				canManager.SendHandshake(handshake::abort(AbortCode::FlashWrite, static_cast<int>(write_status)));
+				status_ = Status::error;
+				return HandshakeResponse::InternalStateMachineError;
+			}
+		}
+		return HandshakeResponse::Ok;
+	}
+
+	HandshakeResponse FirmwareDownloader::erase_remaining_pages() {
+		for (std::size_t page_index = 0; page_index < size(erasedBlocks_); ++page_index) {
+			if (!page_erased_[page_index] && erase_page_on_demand(page_index) != WriteStatus::Ok)
+				return HandshakeResponse::PageEraseFailed;
+		}
+		return HandshakeResponse::Ok;
+	}
+
+	HandshakeResponse FirmwareDownloader::skip_erased_data(std::uint32_t const target) {
+		std::uint32_t const location = expectedWriteLocation();
+		if (target % sizeof(std::uint32_t) != 0 || target <= location || target > end(firmwareBlocks_[current_block_index_]))
+			return HandshakeResponse::CommandInvalidInCurrentContext;
+
+		// Skipped words must not end up in the middle of decompressed word
+		if (stream_compressed_ && decompressed_bytes_ != 0)
+			return HandshakeResponse::CommandInvalidInCurrentContext;
+
+		// Only data of erased pages can be skipped, the content of other pages would be undefined
+		for (std::uint32_t page = Flash::makePageAligned(location); page < target; page = end(Flash::getEnclosingBlock(page)))
+			if (std::ranges::find(erasedBlocks_, Flash::getEnclosingBlock(page)) == end(erasedBlocks_))
+				return HandshakeResponse::CommandInvalidInCurrentContext;
+
+		constexpr std::uint32_t erased_word = 0xFFFF'FFFF;
+		bool const skips_block_end = target == end(firmwareBlocks_[current_block_index_]);
+		while (data_expected() && expectedWriteLocation() < target) {
+			std::uint32_t const address = expectedWriteLocation();
+			std::uint32_t const native_word = address & ~(sizeof(Flash::nativeType) - 1);
+
+			// Words sharing the native word with written data are written as erased. So are all words of bootloader
+			// update (the RAM buffer holds garbage) and the first words of pages erased on demand (to erase them).
+			bool const shares_native_word = native_word != address || native_word + sizeof(Flash::nativeType) > target;
+			bool const page_not_prepared = bootloader_.erasingOnDemand() && (address == location || Flash::isPageAligned(address));
+			if (shares_native_word || bootloader_.updatingBootloader() || page_not_prepared) {
+				if (WriteStatus const status = write_word(address, erased_word); status != WriteStatus::Ok && status != WriteStatus::InsufficientData) {
+					canManager.SendHandshake(handshake::abort(AbortCode::FlashWrite, static_cast<int>(status)));
+					status_ = Status::error;
+					return HandshakeResponse::InternalStateMachineError;
+				}
+			}
+			else
+				advance_write_location();
+		}
+
+		// Nothing of the logical block may stay in RAM (see write)
+		if (skips_block_end && !bootloader_.updatingBootloader())
+			if (WriteStatus const status = flush_writes(); status != WriteStatus::Ok && status != WriteStatus::InsufficientData) {
+				canManager.SendHandshake(handshake::abort(AbortCode::FlashWrite, static_cast<int>(status)));
+				status_ = Status::error;
+				return HandshakeResponse::InternalStateMachineError;
+			}
+
+		skip_unchanged_pages();
+		return HandshakeResponse::Ok;
+	}
+
+	HandshakeResponse FirmwareDownloader::open_stream(std::uint32_t const address, bool const compressed) {
+		// The stream is always opened at the location, where the next addressed Data would be written.
+		if (address != expectedWriteLocation())
+			return HandshakeResponse::CommandInvalidInCurrentContext;
+
+		stream_open_ = stream_synchronized_ = true;
+		stream_sequence_ = 0;
+
+		// Compression restarts with empty dictionary whenever the stream is (re)opened
+		stream_compressed_ = compressed;
+		decompressor_.reset();
+		decompressed_word_ = 0;
+		decompressed_bytes_ = 0;
+		return HandshakeResponse::Ok;
+	}
+
+	WriteStatus FirmwareDownloader::write_decompressed_byte(std::uint8_t const byte) {
+		decompressed_word_ |= static_cast<std::uint32_t>(byte) << (8 * decompressed_bytes_);
+		if (++decompressed_bytes_ < sizeof(decompressed_word_))
+			return WriteStatus::Ok;
+
+		WriteStatus const write_status = write_word(expectedWriteLocation(), decompressed_word_);
+		decompressed_word_ = 0;
+		decompressed_bytes_ = 0;
+		return write_status;
+	}
+
+	WriteStatus FirmwareDownloader::stream_write(unsigned const sequence, std::span<std::uint32_t const> const data) {
+		if (!stream_open_ || !data_expected())
+			return WriteStatus::NotReady;
+
+		// After a lost frame all following stream frames are dropped until the master restarts
+		// the transmission by an addressed Data frame at the expected location.
+		if (!stream_synchronized_ || sequence != stream_sequence_) {
+			stream_synchronized_ = false;
+			return WriteStatus::DiscontinuousWriteAccess;
+		}
+		stream_sequence_ = (stream_sequence_ + 1) % StreamData::sequence_modulus;
+
+		WriteStatus write_status = WriteStatus::Ok;
+		if (stream_compressed_) {
+			// Frames carry little endian bytes of compressed stream. Decompressed bytes are written as whole words
+			auto const output = [this, &write_status](std::uint8_t const byte) {
+				if (!data_expected())
+					return false; // Bits following the end of firmware only pad the last frame
+				write_status = write_decompressed_byte(byte);
+				return write_status == WriteStatus::Ok || write_status == WriteStatus::InsufficientData;
+			};
+			for (std::uint32_t const word : data)
+				for (std::size_t i = 0; i < sizeof(word); ++i)
+					if (!decompressor_.feed(word >> (8 * i), output))
+						return write_status;
+			return write_status;
+		}
+
+		for (std::uint32_t const word : data) {
+			if (!data_expected())
+				break; // Words following the end of firmware only pad the last frame
+			write_status = write_word(expectedWriteLocation(), word);
+			if (write_status != WriteStatus::Ok && write_status != WriteStatus::InsufficientData)
+				break;
+		}
+		return write_status;
+	}
+
 	void FirmwareDownloader::reset() {
 		status_ = Status::unitialized;
 		firmware_size_ = 0_B;
 		written_bytes_ = 0_B;
 
 		current_block_index_ = 0;
-		blockOffset_ = 0;
+		blockOffset_ = checksummed_offset_ = 0;
+
+		stream_open_ = stream_synchronized_ = stream_compressed_ = false;
+		stream_sequence_ = 0;
+		decompressor_.reset();
+		decompressed_word_ = 0;
+		decompressed_bytes_ = 0;
+
+		receive_window_.reset();
+		restart_requested_ = false;
+
+		Flash::DiscardBufferedWrites();
+		Flash::DiscardRow();
+
+		page_erased_.fill(false);
+		page_erased_ahead_.reset();
+		scratch_page_.reset();
+
+		acknowledged_location_ = 0;
+		advertised_credit_ = 0;
 
 		std::ranges::fill(bootloader_update_buffer_begin, bootloader_update_buffer_end, 0xcc'cc'cc'cc);
 	}
@@ -692,36 +1326,60 @@ namespace boot {
 						canManager.set_pending_abort_request(handshake::abort(AbortCode::FirmwareUpload_incorrect_transaction_type, static_cast<int>(bootloader_.transaction_type())));
 						break;
 				}
+				if (bootloader_.rangedReadout()) {
+					firmware_size_ = 0;
+					for (MemoryBlock const& block : logical_memory_map_)
+						firmware_size_ += block.length;
+				}
 				status_ = Status::waitingForFirmwareSizeAck;
 				canManager.SendHandshake(handshake::create(Register::FirmwareSize, Command::None, firmware_size_));
 				return;
 
 			case Status::waitingForFirmwareSizeAck:
+				if (bootloader_.digestOnly()) {
+					start_digests();
+					return;
+				}
 				status_ = Status::sendData;
 				[[fallthrough]];
 
 			case Status::sendData: {
+				// Data is sent in batches independent of the main loop rate. The batch is limited by the credit
+				// granted by the master and by the space in the tx queue (some is left for handshakes).
+				// Each frame carries as many contiguous words of the current block as the bus allows (CAN FD)
+				while (sending_data() && word_index_ < credit_end_index_) {
+					if (current_block_->length % sizeof(std::uint32_t) != 0) {
+						canManager.set_pending_abort_request(handshake::abort(AbortCode::LogicalMemoryMapBlockLengthNotMultipleOf4, current_block_->length));
+						__BKPT();
+						return;
+					}
 
-				if (canManager.get_tx_buffer_size() > max_tx_buffer_fill_by_data)
-					return; // Can't proceed now, buffer is almost full!
-
-				std::uint32_t const absolute_address = current_block_->address + offset_in_block_;
-				std::uint32_t const word = ufsel::bit::access_register(absolute_address);
-				canManager.SendData(absolute_address, word);
-
-				offset_in_block_ += sizeof(std::uint32_t);
+					std::uint32_t const absolute_address = current_block_->address + offset_in_block_;
+					std::size_t const words_left_in_block = (current_block_->length - offset_in_block_) / sizeof(std::uint32_t);
+					std::size_t const word_count = canManager.data_frame_capacity(std::min<std::size_t>(words_left_in_block, credit_end_index_ - word_index_));
+					if (canManager.get_tx_queue_free_space() == 0)
+						break;
 
-				if (offset_in_block_ > current_block_->length) {
-					canManager.set_pending_abort_request(handshake::abort(AbortCode::LogicalMemoryMapBlockLengthNotMultipleOf4, current_block_->length));
-					__BKPT();
-				}
+					std::array<std::uint32_t, BulkData::max_words> words;
+					for (std::size_t i = 0; i < word_count; ++i) {
+						words[i] = ufsel::bit::access_register(absolute_address + i * sizeof(std::uint32_t));
+						if (word_index_++ == checksummed_words_) {
+							Crc32::update(words[i]);
+							++checksummed_words_;
+						}
+					}
+					canManager.SendData(absolute_address, std::span{words.data(), word_count});
+					offset_in_block_ += word_count * sizeof(std::uint32_t);
 
-				if (offset_in_block_ == current_block_->length) {
-					offset_in_block_ = 0;
-					if (++current_block_ == std::to_address(logical_memory_map_.end()))
-						status_ = Status::waitForDataAck;
+					if (offset_in_block_ == current_block_->length) {
+						offset_in_block_ = 0;
+						if (++current_block_ == std::to_address(logical_memory_map_.end()))
+							status_ = Status::waitForDataAck;
+					}
 				}
 
+				// Fill the free mailboxes right away instead of waiting for the next iteration of the main loop
+				process_all_tx_fifos();
 				return;
 			}
 			case Status::waitForDataAck:
@@ -730,6 +1388,14 @@ namespace boot {
 				canManager.set_pending_abort_request(handshake::abort(AbortCode::UnexpectedDataAck));
 				return;
 
+			case Status::computingDigests:
+				compute_digests();
+				return;
+
+			case Status::sendingDigest:
+				send_next_checksum();
+				return;
+
 			case Status::sentChecksum:
 				status_ = Status::done;
 				canManager.SendTransactionMagic();
@@ -746,12 +1412,123 @@ namespace boot {
 		assert_unreachable();
 	}
 
-	void FirmwareUploader::handle_data_ack() {
-		if (ack_expected()) {
-			canManager.SendHandshake(handshake::create(Register::Checksum, Command::None, calculate_checksum(logical_memory_map_, false)));
+	std::optional<std::uint32_t> FirmwareUploader::word_index_of(std::uint32_t const address) const {
+		std::uint32_t index = 0;
+		for (MemoryBlock const& block : logical_memory_map_) {
+			if (block.contains_address(address))
+				return index + (address - block.address) / sizeof(std::uint32_t);
+			index += block.length / sizeof(std::uint32_t);
+		}
+		return std::nullopt;
+	}
+
+	void FirmwareUploader::handle_data_ack(std::uint32_t const address, std::uint16_t const credit) {
+		// The master acknowledges the last word received (or the word preceding the firmware, before it got any)
+		std::optional<std::uint32_t> acknowledged_words = 0;
+		if (address != logical_memory_map_.front().address - sizeof(std::uint32_t))
+			if (acknowledged_words = word_index_of(address); acknowledged_words.has_value())
+				++*acknowledged_words;
+
+		if (!acknowledged_words.has_value()) {
+			// The master acknowledges data we have never sent. Its view of the transaction can't be trusted
+			status_ = Status::error;
+			canManager.set_pending_abort_request(handshake::abort(AbortCode::UnexpectedDataAck, address));
+			return;
+		}
+
+		credit_end_index_ = std::max(credit_end_index_, *acknowledged_words + credit);
+
+		if (ack_expected() && *acknowledged_words == word_index_) {
+			checksum_ = Crc32::value();
+			if (bootloader_.blockDigests())
+				start_digests();
+			else {
+				canManager.SendHandshake(handshake::create(Register::Checksum, Command::None, checksum_));
+				status_ = Status::sentChecksum;
+			}
+		}
+	}
+
+	void FirmwareUploader::start_digests() {
+		checksum_block_index_ = 0;
+		digest_offset_ = 0;
+		image_digest_sent_ = false;
+		block_hash_.reset();
+		image_hash_.reset();
+		status_ = Status::computingDigests;
+	}
+
+	void FirmwareUploader::compute_digests() {
+		// Digests of blocks and of the image are computed in a single pass over the memory
+		MemoryBlock const& block = logical_memory_map_[checksum_block_index_];
+		std::uint32_t const chunk_end = std::min(end(block), block.address + digest_offset_ + digest_chunk_size);
+		for (std::uint32_t address = block.address + digest_offset_; address < chunk_end; address += sizeof(std::uint32_t)) {
+			std::uint32_t const word = ufsel::bit::access_register(address);
+			if (bootloader_.blockDigests())
+				block_hash_.update(word);
+			if (bootloader_.digestOnly())
+				image_hash_.update(word);
+		}
+		digest_offset_ = chunk_end - block.address;
+		if (digest_offset_ < block.length)
+			return;
+
+		digest_offset_ = 0;
+		++checksum_block_index_;
+		if (bootloader_.blockDigests()) {
+			send_digest(block_hash_.finish());
+			block_hash_.reset();
+		}
+		else if (checksum_block_index_ == size(logical_memory_map_)) {
+			send_digest(image_hash_.finish());
+			image_digest_sent_ = true;
+		}
+	}
+
+	void FirmwareUploader::send_digest(Sha256::Digest const& digest) {
+		digest_ = digest;
+		digest_words_sent_ = 1;
+		canManager.SendHandshake(handshake::create(Register::Checksum, Command::None, digest_[0]));
+		status_ = Status::sendingDigest;
+	}
+
+	void FirmwareUploader::send_next_checksum() {
+		if (digest_words_sent_ < size(digest_)) {
+			canManager.SendHandshake(handshake::create(Register::Checksum, Command::None, digest_[digest_words_sent_++]));
+			return;
+		}
+
+		// The whole digest has been acknowledged. Digests of blocks go first, the digest (or checksum) of the image last
+		if (!image_digest_sent_ && checksum_block_index_ < size(logical_memory_map_)) {
+			status_ = Status::computingDigests;
+			return;
+		}
+		if (!image_digest_sent_ && bootloader_.digestOnly()) {
+			send_digest(image_hash_.finish());
+			image_digest_sent_ = true;
+			return;
+		}
+		if (!image_digest_sent_) {
+			canManager.SendHandshake(handshake::create(Register::Checksum, Command::None, checksum_));
 			status_ = Status::sentChecksum;
+			return;
 		}
-		//TODO handle unexpected DataAck?
+		status_ = Status::done;
+		canManager.SendTransactionMagic();
+	}
+
+	HandshakeResponse FirmwareUploader::restart_from_address(std::uint32_t const address) {
+		auto const containing_block = std::ranges::find_if(logical_memory_map_, [address](MemoryBlock const& block) { return block.contains_address(address);});
+		if (containing_block == logical_memory_map_.end() || address % sizeof(std::uint32_t) != 0)
+			return HandshakeResponse::CommandInvalidInCurrentContext;
+
+		current_block_ = std::to_address(containing_block);
+		offset_in_block_ = address - containing_block->address;
+		word_index_ = *word_index_of(address);
+		// Words lost after the end of firmware have to be sent again as well
+		if (status_ == Status::waitForDataAck)
+			status_ = Status::sendData;
+		return HandshakeResponse::Ok;
 	}
 
 	HandshakeResponse Bootloader::validateVectorTable(AddressSpace const expected_space, std::uint32_t const address) {
@@ -924,11 +1701,45 @@ namespace boot {
 		return HandshakeResponse::Ok;
 	}
 
+	bool Bootloader::oldFirmwareContains(std::uint32_t const address, std::uint32_t const length) const {
+		std::span const blocks{old_firmware_blocks_.begin(), old_firmware_block_count_};
+		return std::ranges::any_of(blocks, [=](MemoryBlock const& block) {
+			return address >= block.address && length <= end(block) - address;
+		});
+	}
+
 	HandshakeResponse Bootloader::processHandshake(Register const reg, Command const command, std::uint32_t const value) {
 
 		if (reg != Register::Command && command != Command::None)
 			return HandshakeResponse::CommandNotNone;
 
+		if (reg == Register::Argument) {
+			// Operands are stored until the next command arrives
+			if (!transactionInProgress() && status_ != Status::Initialization)
+				return HandshakeResponse::HandshakeNotExpected;
+			if (argument_count_ == size(arguments_))
+				return HandshakeResponse::HandshakeSequenceError;
+			arguments_[argument_count_++] = value;
+			return HandshakeResponse::Ok;
+		}
+
+		handshakeAckPostponed_ = false;
+		HandshakeResponse const response = dispatchHandshake(reg, command, value);
+		argument_count_ = 0; // Arguments apply only to the handshake immediately following them
+		return response;
+	}
+
+	HandshakeResponse Bootloader::setStripedTransfer() {
+		// Argument bit 3 of any transaction start stripes the Data frames over all buses. It makes sense only with more of them
+		stripedTransfer_ = argument(0).value_or(0) & 8;
+		if (stripedTransfer_ && canManager.bus_count() < 2) {
+			stripedTransfer_ = false;
+			return HandshakeResponse::CommandInvalidInCurrentContext;
+		}
+		return HandshakeResponse::Ok;
+	}
+
+	HandshakeResponse Bootloader::dispatchHandshake(Register const reg, Command const command, std::uint32_t const value) {
 		switch (status_) {
 		case Status::Ready:
 			if (auto const res = checkMagic(reg, value); res != HandshakeResponse::Ok)
@@ -944,14 +1755,42 @@ namespace boot {
 			switch (command) {
 			case Command::StartTransactionFlashing:
 			case Command::StartBootloaderUpdate:
-				status_ = Status::TransmittingPhysicalMemoryBlocks;
+				if (auto const response = setStripedTransfer(); response != HandshakeResponse::Ok)
+					return response;
 				transactionType_ = command == Command::StartTransactionFlashing ? TransactionType::Flashing : TransactionType::BootloaderUpdate;
+
+				// Flashing with argument bit 1 set erases pages on demand instead of during the erasure subtransaction.
+				eraseOnDemand_ = command == Command::StartTransactionFlashing && argument(0).value_or(0) & 2;
+
+				// Flashing with argument bit 0 set is a delta update - the master sends patch against the current firmware
+				if (command == Command::StartTransactionFlashing && argument(0).value_or(0) & 1) {
+					if (!jumpTable.has_valid_metadata())
+						return HandshakeResponse::CommandInvalidInCurrentContext;
+					old_firmware_block_count_ = jumpTable.logical_memory_block_count_;
+					std::copy_n(jumpTable.logical_memory_blocks_.begin(), old_firmware_block_count_, old_firmware_blocks_.begin());
+					transactionType_ = TransactionType::DeltaFlashing;
+				}
+
+				status_ = Status::TransmittingPhysicalMemoryBlocks;
 				physicalMemoryMapTransmitter_.startSubtransaction();
 				return HandshakeResponse::Ok;
 			case Command::StartFirmwareReadout:
 			case Command::StartBootloaderReadout:
+				if (auto const response = setStripedTransfer(); response != HandshakeResponse::Ok)
+					return response;
 				status_ = Status::TransmittingMemoryMap;
 				transactionType_ = command == Command::StartFirmwareReadout ? TransactionType::FirmwareReadout : TransactionType::BootloaderReadout;
+				// Readout with argument bit 0 set verifies the memory - only its checksum is sent instead of data.
+				// Bit 1 adds checksums of individual logical memory blocks
+				digestOnly_ = argument(0).value_or(0) & 1;
+				blockDigests_ = argument(0).value_or(0) & 2;
+				// Bit 2 selects ranged readout - the master first sends the ranges to read in form of logical memory map
+				rangedReadout_ = argument(0).value_or(0) & 4;
+				if (rangedReadout_) {
+					status_ = Status::ReceivingFirmwareMemoryMap;
+					logicalMemoryMapReceiver_.startSubtransaction();
+					return HandshakeResponse::Ok;
+				}
 				logicalMemoryMapTransmitter_.startSubtransaction();
 				return HandshakeResponse::Ok;
 			case Command::SetNewVectorTable: {
@@ -974,7 +1813,12 @@ namespace boot {
 		case Status::ReceivingFirmwareMemoryMap: {
 
 			auto const result = logicalMemoryMapReceiver_.receive(reg, command, value);
-			if (logicalMemoryMapReceiver_.done()) {
+			if (logicalMemoryMapReceiver_.done() && readingOut()) {
+				// Ranged readout continues as a regular one, only the received ranges replace the memory map
+				status_ = Status::TransmittingMemoryMap;
+				logicalMemoryMapTransmitter_.startSubtransaction(logicalMemoryMapReceiver_.logicalMemoryBlocks());
+			}
+			else if (logicalMemoryMapReceiver_.done()) {
 				status_ = Status::ErasingPhysicalBlocks;
 				physicalMemoryBlockEraser_.startSubtransaction();
 			}
@@ -982,10 +1826,13 @@ namespace boot {
 		}
 		case Status::ErasingPhysicalBlocks: {
 
+			bool const was_erasing = physicalMemoryBlockEraser_.erasing();
 			auto const result = physicalMemoryBlockEraser_.receive(reg, command, value);
+			// The eraser acknowledges the page once its erasure finishes
+			handshakeAckPostponed_ = !was_erasing && physicalMemoryBlockEraser_.erasing();
 			if (physicalMemoryBlockEraser_.done()) {
 				status_ = Status::DownloadingFirmware;
-				firmwareDownloader_.startSubtransaction(physicalMemoryBlockEraser_.erased_pages(), logicalMemoryMapReceiver_.logicalMemoryBlocks());
+				firmwareDownloader_.startSubtransaction(physicalMemoryBlockEraser_.erased_pages(), physicalMemoryBlockEraser_.unchanged_pages(), logicalMemoryMapReceiver_.logicalMemoryBlocks());
 			}
 			return result;
 
@@ -1018,8 +1865,7 @@ namespace boot {
 
 		case Status::UploadingFirmware:
 			if (reg == Register::Command && command == Command::RestartFromAddress) {
-				firmwareUploader_.restart_from_address(value);
-				return HandshakeResponse::Ok;
+				return firmwareUploader_.restart_from_address(value);
 			}
 			else
 				return HandshakeResponse::HandshakeNotExpected;
@@ -1095,10 +1941,10 @@ namespace boot {
 		assert_unreachable();
 	}
 
-	bool Bootloader::processDataAck(Bootloader_WriteResult result) {
+	bool Bootloader::processDataAck(std::uint32_t const address, Bootloader_WriteResult result, std::uint16_t const credit) {
 		switch (status_) {
 			case Status::UploadingFirmware:
-				firmwareUploader_.handle_data_ack();
+				firmwareUploader_.handle_data_ack(address, credit);
 				return true;
 				break;
 
@@ -1111,10 +1957,18 @@ namespace boot {
 	void Bootloader::update() {
 		switch (status_) {
 			case Status::UploadingFirmware:
-				if (firmwareUploader_.sending_data())
+				if (firmwareUploader_.sending_data() || firmwareUploader_.computing_digests())
 					firmwareUploader_.update();
 				break;
 
+			case Status::ErasingPhysicalBlocks:
+				physicalMemoryBlockEraser_.update();
+				break;
+
+			case Status::DownloadingFirmware:
+				firmwareDownloader_.update();
+				break;
+
 			default:
 				// No operation, everything is handled from CAN message handlers such as processHandshake
 				break;
@@ -13,14 +13,19 @@
 #include <type_traits>
 #include <optional>
 #include <span>
+#include <bitset>
 
 #include <ufsel/assert.hpp>
 #include <ufsel/units.hpp>
+#include <ufsel/time.hpp>
 
 #include "flash.hpp"
 #include "can_Bootloader.h"
 #include "enums.hpp"
 #include "canmanager.hpp"
+#include "decompressor.hpp"
+#include "crc.hpp"
+#include "sha256.hpp"
 
 namespace boot {
 
@@ -30,6 +35,7 @@ namespace boot {
 		BootloaderUpdate = 2,
 		FirmwareReadout = 3,
 		BootloaderReadout = 4,
+		DeltaFlashing = 5, // Flashing of firmware patch against the currently flashed firmware
 	};
 
 	class Bootloader;
@@ -136,6 +142,8 @@ namespace boot {
 		[[nodiscard]] bool done() const { return status_ == Status::done; }
 		[[nodiscard]] bool error() const { return status_ == Status::error; }
 		void startSubtransaction();
+		// Transmits given blocks instead of the memory map of firmware / bootloader (ranged readout)
+		void startSubtransaction(std::span<MemoryBlock const> blocks);
 		void endSubtransaction() { status_ = Status::done; }
 		void processYield() { status_ = Status::masterYielded; }
 		Bootloader_Handshake_t update();
@@ -166,22 +174,81 @@ namespace boot {
 		Status status_ = Status::uninitialized;
 		std::array<MemoryBlock, customization::NumPhysicalBlocksPerBank> erased_pages_;
 		std::uint32_t erased_pages_count_ = 0, expectedPageCount_ = 0;
+		// Pages whose digest matched the digest of new content sent by the master. They are kept intact.
+		std::array<MemoryBlock, customization::NumPhysicalBlocksPerBank> unchanged_pages_;
+		std::uint32_t unchanged_pages_count_ = 0;
+		std::optional<MemoryBlock> page_being_erased_;
 
 	public:
 		bool done() const { return status_ == Status::done; }
+		bool erasing() const { return page_being_erased_.has_value(); }
 		void startSubtransaction() { status_ = Status::pending; }
 		HandshakeResponse receive(Register, Command, std::uint32_t);
 
 		std::span<MemoryBlock const> erased_pages() const { return std::span{erased_pages_.begin(), erased_pages_count_}; }
+		std::span<MemoryBlock const> unchanged_pages() const { return std::span{unchanged_pages_.begin(), unchanged_pages_count_}; }
 		HandshakeResponse tryErasePage(std::uint32_t address);
+		// Finishes the background erasure and acknowledges it to the master, called periodically from the main loop
+		void update();
 
 		using BootloaderSubtransactionBase::BootloaderSubtransactionBase;
 
 		void reset() {
 			status_ = Status::uninitialized;
 			erased_pages_count_ = 0;
+			unchanged_pages_count_ = 0;
 			expectedPageCount_ = 0;
+			page_being_erased_.reset();
+		}
+	};
+
+	// Reorder window of the firmware download (selective repeat). Words received ahead of the expected write location
+	// are staged in RAM until the missing words preceding them get retransmitted. Position zero of the window
+	// is the expected write location itself, hence it is never staged.
+	class ReceiveWindow {
+	public:
+		// One bit of the received bitmap per word. Wide enough to merge Data frames of a striped transfer
+		// arriving over several buses (a few CAN FD frames may overtake each other)
+		constexpr static std::size_t length = 64;
+		// When more words are missing, it is cheaper to restart the transmission from the expected location
+		constexpr static int max_retransmitted_words = 4;
+
+	private:
+		std::array<std::uint32_t, length> staged_words_;
+		std::uint64_t received_ = 0; // Bit i is set iff the word at position i is staged
+		std::size_t head_ = 0; // Index of position zero within staged_words_
+
+		// Retransmission timer adapted to the measured round trip time (request sent -> missing word received)
+		constexpr static std::uint32_t initial_rtt_ms = 10, min_timeout_ms = 2, max_timeout_ms = 100;
+		std::optional<Timestamp> request_sent_;
+		bool request_repeated_ = false;
+		std::uint32_t smoothed_rtt_ms_ = initial_rtt_ms, timeout_ms_ = 2 * initial_rtt_ms;
+
+	public:
+		void stage(std::size_t const position, std::uint32_t const word) {
+			assert(position > 0 && position < length);
+			staged_words_[(head_ + position) % length] = word;
+			received_ |= std::uint64_t{1} << position;
+		}
+
+		[[nodiscard]] bool empty() const { return received_ == 0; }
+		[[nodiscard]] bool has_expected_word() const { return received_ & 1u; }
+		[[nodiscard]] std::uint32_t expected_word() const { return staged_words_[head_]; }
+
+		// Bitmap of positions preceding the furthest staged word, that have not been received yet
+		[[nodiscard]] std::uint64_t missing() const;
+
+		// Moves the window one word further after the word at the expected location has been written
+		void shift() {
+			received_ >>= 1;
+			head_ = (head_ + 1) % length;
 		}
+
+		[[nodiscard]] bool retransmission_due() const;
+		void retransmission_requested();
+		void expected_word_received();
+
+		void reset();
 	};
 
 	class FirmwareDownloader : public BootloaderSubtransactionBase {
@@ -198,11 +265,66 @@ namespace boot {
 
 		Status status_ = Status::unitialized;
 		InformationSize firmware_size_ = 0_B, written_bytes_ = 0_B;
-		std::span<MemoryBlock const> erasedBlocks_;
+		std::span<MemoryBlock const> erasedBlocks_, unchangedBlocks_;
 		std::span<MemoryBlock const> firmwareBlocks_;
 		std::size_t current_block_index_ = 0;
 		std::uint32_t blockOffset_ = 0;
 
+		// Data stream state. Stream frames are accepted only while synchronized with the master; synchronization
+		// is lost on sequence mismatch and regained by an addressed Data frame at the expected location.
+		// Compressed stream can be resynchronized only by opening it again (decompressor's state is lost).
+		bool stream_open_ = false, stream_synchronized_ = false, stream_compressed_ = false;
+		unsigned stream_sequence_ = 0;
+
+		Decompressor decompressor_;
+		std::uint32_t decompressed_word_ = 0; // Decompressed bytes of the word not yet written
+		std::size_t decompressed_bytes_ = 0;
+
+		WriteStatus write_decompressed_byte(std::uint8_t byte);
+
+		ReceiveWindow receive_window_;
+		bool restart_requested_ = false;
+
+		// Pages erased on demand, indexed the same way as erasedBlocks_. Delta update keeps the old content
+		// of the page being rewritten in RAM (bootloader update buffer), so that it can still serve as source of copies.
+		std::array<bool, customization::NumPhysicalBlocksPerBank> page_erased_{};
+		std::optional<MemoryBlock> scratch_page_;
+
+		std::optional<std::size_t> page_erased_ahead_; // Index of the page being erased in the background
+
+		WriteStatus erase_page_on_demand(std::size_t page_index);
+		WriteStatus finish_erase_ahead();
+		// Programs all buffered data
+		WriteStatus flush_writes();
+		WriteStatus prepare_page(std::uint32_t address);
+		// Erases the next scheduled page ahead of the expected write location while the main loop is idle
+		void erase_ahead();
+		[[nodiscard]] std::optional<std::uint32_t> read_old_word(std::uint32_t address) const;
+		HandshakeResponse copy_from_old_firmware(std::uint32_t source, std::uint32_t length);
+		HandshakeResponse erase_remaining_pages();
+
+		// Checksum of every logical block. Blocks whose checksum does not match can be downloaded again (repaired)
+		constexpr static std::size_t max_blocks = std::tuple_size_v<decltype(ApplicationJumpTable::logical_memory_blocks_)>;
+		std::array<std::uint32_t, max_blocks> block_checksums_{};
+		std::bitset<max_blocks> corrupted_blocks_;
+		std::size_t end_block_index_ = 0; // One past the last block being downloaded
+		std::size_t checksum_block_index_ = 0; // Block whose checksum is expected next
+		std::uint32_t checksummed_offset_ = 0; // Offset in the current block, up to which words have been fed to the checksum
+
+		HandshakeResponse receive_checksum(std::uint32_t checksum);
+		// Erases pages of the corrupted block starting at given address and rewinds the download to its start
+		HandshakeResponse repair_block(std::uint32_t address);
+
+		// Cumulative acknowledgement of written data carrying the receive credit (flow control of the master)
+		constexpr static auto credit_period = 5_ms, credit_keepalive_period = 100_ms;
+		SysTickTimer credit_timer_, credit_keepalive_timer_;
+		std::uint32_t acknowledged_location_ = 0;
+		std::uint16_t advertised_credit_ = 0;
+
+		// Number of words the master may send beyond the last written word without overflowing our buffers
+		[[nodiscard]] static std::uint16_t receive_credit();
+		void advertise_credit();
+
 		static int calculate_padding_width(std::uint32_t address, std::uint32_t const data, MemoryBlock const * next_block);
 
 		void schedule_data_write(std::uint32_t const address, std::uint32_t const data, bool is_last_write_in_logical_block);
@@ -213,10 +335,7 @@ namespace boot {
 
 		static WriteStatus update_flash_write_buffer();
 
-	public:
-		WriteStatus checkAddressBeforeWrite(std::uint32_t address, std::uint32_t data) const;
-
-		WriteStatus check_and_write(std::uint32_t address, std::uint32_t const data) {
+		WriteStatus write_word(std::uint32_t address, std::uint32_t const data) {
 			if (!data_expected())
 				return WriteStatus::NotReady;
 
@@ -225,23 +344,93 @@ namespace boot {
 
 			auto const write_status = write(address, data);
 
-			// Update internal counters etc
-			written_bytes_ += InformationSize::fromBytes(sizeof(data));
-			blockOffset_ += sizeof(data);
-			if (blockOffset_ == firmwareBlocks_[current_block_index_].length) {
-				blockOffset_ = 0;
-				if (++current_block_index_ == size(firmwareBlocks_))
-					status_ = Status::noMoreDataExpected;
-			}
+			advance_write_location();
+			skip_unchanged_pages();
+			return write_status;
+		}
+
+		// Update internal counters etc. The checksum of each block is accumulated from its words in order of their addresses
+		void advance_write_location() {
+			written_bytes_ += InformationSize::fromBytes(sizeof(std::uint32_t));
+			receive_window_.shift();
+			blockOffset_ += sizeof(std::uint32_t);
+			if (blockOffset_ == firmwareBlocks_[current_block_index_].length)
+				finish_block();
+			else
+				checksum_committed_words();
+		}
+
+		// Feeds the checksum with words of the current block that have already been programmed. They are read back
+		// from flash (or from the bootloader update buffer), so that the checksum verifies what has actually been written
+		void checksum_committed_words();
+		// Commits the rest of the current block, stores its checksum and moves to the next one
+		void finish_block();
+
+		// The last expected word has been written (or skipped). Acknowledges the end of data to the master
+		void finish_data();
+
+		// Moves the expected write location past pages that were kept intact (the master does not send their data)
+		void skip_unchanged_pages();
+
+		void synchronize_stream() {
+			if (stream_compressed_)
+				return;
+			stream_synchronized_ = stream_open_;
+			stream_sequence_ = 0;
+		}
+
+		HandshakeResponse open_stream(std::uint32_t address, bool compressed);
 
+		// Moves the expected write location to given address. Skipped data are left erased
+		HandshakeResponse skip_erased_data(std::uint32_t target);
+		// Writes the word repeatedly to the expected write location (run length encoded data)
+		HandshakeResponse fill(std::uint32_t word, std::uint32_t count);
+
+		// Position of given address in the receive window (distance in words from the expected write location)
+		[[nodiscard]] std::optional<std::size_t> window_position(std::uint32_t address) const;
+		[[nodiscard]] std::uint32_t window_address(std::size_t position) const;
+
+	public:
+		WriteStatus checkAddressBeforeWrite(std::uint32_t address, std::uint32_t data) const;
+
+		WriteStatus check_and_write(std::uint32_t address, std::uint32_t const data);
+
+		// Writes contiguous words starting at given address (e.g. payload of CAN FD Data frame).
+		// Words preceding the expected write location are skipped, words ahead of it are staged in the receive window.
+		// The first other failure terminates the write.
+		WriteStatus check_and_write(std::uint32_t address, std::span<std::uint32_t const> const data) {
+			WriteStatus write_status = WriteStatus::Ok;
+			for (std::uint32_t const word : data) {
+				write_status = check_and_write(address, word);
+				if (write_status != WriteStatus::Ok && write_status != WriteStatus::InsufficientData && write_status != WriteStatus::AlreadyWritten && write_status != WriteStatus::Staged)
+					break;
+				address += sizeof(word);
+			}
 			return write_status;
 		}
 
+		// Writes words of the data stream frame with given sequence number to the expected write location
+		WriteStatus stream_write(unsigned sequence, std::span<std::uint32_t const> data);
+
+		// The master shall restart the transmission from the expected write location (go-back-N)
+		void request_restart() { restart_requested_ = true; }
+		// Advertises receive credit and requests retransmission of lost words, called periodically from the main loop
+		void update();
+
 		[[nodiscard]] bool done() const { return status_ == Status::done; }
 		[[nodiscard]] bool data_expected() const { return status_ == Status::receivingData; }
-		void startSubtransaction(std::span<MemoryBlock const> erasedBlocks, std::span<MemoryBlock const> firmwareBlocks) {
+		// The master has been granted credit for more data, i.e. it is not expected to stay silent
+		[[nodiscard]] bool credit_outstanding() const { return data_expected() && advertised_credit_ != 0; }
+		void startSubtransaction(std::span<MemoryBlock const> erasedBlocks, std::span<MemoryBlock const> unchangedBlocks, std::span<MemoryBlock const> firmwareBlocks) {
 			erasedBlocks_ = erasedBlocks;
+			unchangedBlocks_ = unchangedBlocks;
 			firmwareBlocks_ = firmwareBlocks;
+			end_block_index_ = size(firmwareBlocks);
+			checksum_block_index_ = 0;
+			corrupted_blocks_.reset();
+			// Nothing left over from previous (aborted) transaction may reach the flash
+			Flash::DiscardBufferedWrites();
+			Flash::DiscardRow();
 			status_ = Status::pending;
 		}
 		HandshakeResponse receive(Register, Command, std::uint32_t);
@@ -253,6 +442,14 @@ namespace boot {
 			return firmwareBlocks_[current_block_index_].address + blockOffset_;
 		}
 
+		// Location of the last word written. Valid only if at least one word has been written
+		[[nodiscard]] std::uint32_t lastWriteLocation() const {
+			if (blockOffset_ != 0)
+				return expectedWriteLocation() - sizeof(std::uint32_t);
+			MemoryBlock const& previous = firmwareBlocks_[current_block_index_ - 1];
+			return previous.address + previous.length - sizeof(std::uint32_t);
+		}
+
 		using BootloaderSubtransactionBase::BootloaderSubtransactionBase;
 
 		void reset();
@@ -267,6 +464,8 @@ namespace boot {
 			waitingForFirmwareSizeAck,
 			sendData,
 			waitForDataAck,
+			computingDigests,
+			sendingDigest,
 			sentChecksum,
 
 			done,
@@ -279,24 +478,52 @@ namespace boot {
 		MemoryBlock const* current_block_ = nullptr;
 		std::uint32_t offset_in_block_ = 0;
 
+		// Checksum is accumulated from sent words, a word retransmitted after restart is not counted twice
+		std::uint32_t word_index_ = 0, checksummed_words_ = 0;
+		// Words may be sent only up to this index (exclusive). Advanced by credit granted in DataAck by the master
+		std::uint32_t credit_end_index_ = 0;
+
+		// Checksum of the whole image, sent after the digests of individual blocks (if requested)
+		std::uint32_t checksum_ = 0;
+
+		// SHA-256 digests of individual blocks and of the whole image. They are computed in the main loop by chunks,
+		// so that the bootloader stays responsive. Each digest is sent by eight Checksum handshakes (words H0 to H7)
+		constexpr static std::uint32_t digest_chunk_size = 1024;
+		Sha256 block_hash_, image_hash_;
+		std::size_t checksum_block_index_ = 0; // Block being digested
+		std::uint32_t digest_offset_ = 0; // Offset in the block being digested
+		Sha256::Digest digest_{};
+		std::size_t digest_words_sent_ = 0;
+		bool image_digest_sent_ = false;
+
+		void start_digests();
+		void compute_digests();
+		void send_digest(Sha256::Digest const& digest);
+		// Continues after the previous Checksum handshake has been acknowledged
+		void send_next_checksum();
+
+		// Index of the word at given address counted from the start of the logical memory map
+		[[nodiscard]] std::optional<std::uint32_t> word_index_of(std::uint32_t address) const;
+
 	public:
 		[[nodiscard]] bool done() const { return status_ == Status::done; }
 		[[nodiscard]] bool error() const { return status_ == Status::error; }
 		[[nodiscard]] bool ack_expected() const { return status_ == Status::waitForDataAck; }
 		[[nodiscard]] bool sending_data() const { return status_ == Status::sendData; }
+		[[nodiscard]] bool computing_digests() const { return status_ == Status::computingDigests; }
 		void startSubtransaction(std::span<MemoryBlock const> logical_memory_map) {
 			status_ = Status::pending;
 			logical_memory_map_ = logical_memory_map;
 			current_block_ = std::to_address(logical_memory_map.begin());
+			word_index_ = checksummed_words_ = credit_end_index_ = 0;
+			checksum_block_index_ = 0;
+			Crc32::reset();
 		}
 		void endSubtransaction() { status_ = Status::done; }
+		// Sends as many words as the credit and free space of the tx buffer allow
 		void update();
-		void handle_data_ack();
-		void restart_from_address(std::uint32_t address) {
-			auto const containing_block = std::ranges::find_if(logical_memory_map_, [address](MemoryBlock const& block) { return block.contains_address(address);});
-			current_block_ = std::to_address(containing_block);
-			offset_in_block_ = address - containing_block->address;
-		}
+		void handle_data_ack(std::uint32_t address, std::uint16_t credit);
+		HandshakeResponse restart_from_address(std::uint32_t address);
 
 		using BootloaderSubtransactionBase::BootloaderSubtransactionBase;
 
@@ -305,6 +532,7 @@ namespace boot {
 			firmware_size_ = 0;
 			current_block_ = nullptr;
 			offset_in_block_ = 0;
+			word_index_ = checksummed_words_ = credit_end_index_ = 0;
 		}
 	};
 
@@ -392,14 +620,59 @@ namespace boot {
 		MetadataTransmitter metadataTransmitter_;
 
 		Status status_ = Status::Ready;
-		bool stall_ = false;
 		TransactionType transactionType_ = TransactionType::Unknown;
 		static inline EntryReason entryReason_ = EntryReason::Unknown;
 
+		std::array<std::uint32_t, 2> arguments_;
+		std::size_t argument_count_ = 0;
+
+		// Pages scheduled for erasure are erased only once the download reaches them (see Bootloader::erasingOnDemand)
+		bool eraseOnDemand_ = false;
+		// Readout sends only the checksum instead of data / sends checksums of individual logical blocks as well
+		bool digestOnly_ = false, blockDigests_ = false;
+		// Readout of address ranges specified by the master (sent as a logical memory map) instead of the whole image
+		bool rangedReadout_ = false;
+		// Data frames are spread over all buses of the bootloader, handshakes stay on the bus used by the master
+		bool stripedTransfer_ = false;
+
+		// The response to the last handshake is sent later by the subtransaction (e.g. once the page erasure finishes)
+		bool handshakeAckPostponed_ = false;
+
+		// Logical memory blocks of the firmware being patched. Copied from the jump table, which gets invalidated
+		decltype(ApplicationJumpTable::logical_memory_blocks_) old_firmware_blocks_;
+		std::size_t old_firmware_block_count_ = 0;
+
+		HandshakeResponse dispatchHandshake(Register reg, Command command, std::uint32_t value);
+		HandshakeResponse setStripedTransfer();
+
 	public:
 		[[nodiscard]] TransactionType transaction_type() const { return transactionType_; }
 		[[nodiscard]] bool updatingBootloader() const { return transactionType_ == TransactionType::BootloaderUpdate; }
-		[[nodiscard]] AddressSpace expectedAddressSpace() const { return updatingBootloader() ? AddressSpace::BootloaderFlash : AddressSpace::ApplicationFlash; }
+		[[nodiscard]] bool patchingFirmware() const { return transactionType_ == TransactionType::DeltaFlashing; }
+		// Erasure subtransaction only registers the pages, each of them is erased right before the download reaches it
+		[[nodiscard]] bool erasingOnDemand() const { return eraseOnDemand_ || patchingFirmware(); }
+
+		[[nodiscard]] bool digestOnly() const { return digestOnly_; }
+		[[nodiscard]] bool blockDigests() const { return blockDigests_; }
+		[[nodiscard]] bool rangedReadout() const { return rangedReadout_; }
+		[[nodiscard]] bool stripedTransfer() const { return stripedTransfer_; }
+		[[nodiscard]] bool readingOut() const { return transactionType_ == TransactionType::FirmwareReadout || transactionType_ == TransactionType::BootloaderReadout; }
+
+		[[nodiscard]] bool handshakeAckPostponed() const { return handshakeAckPostponed_; }
+
+		// Operands of the command being received (see Register::Argument)
+		[[nodiscard]] std::optional<std::uint32_t> argument(std::size_t const index) const {
+			if (index >= argument_count_)
+				return std::nullopt;
+			return arguments_[index];
+		}
+
+		// Returns true iff given range lies within the firmware present before the delta update started
+		[[nodiscard]] bool oldFirmwareContains(std::uint32_t address, std::uint32_t length) const;
+		[[nodiscard]] AddressSpace expectedAddressSpace() const {
+			bool const bootloader_memory = updatingBootloader() || transactionType_ == TransactionType::BootloaderReadout;
+			return bootloader_memory ? AddressSpace::BootloaderFlash : AddressSpace::ApplicationFlash;
+		}
 
 	private:
 		//Sets the jumpTable
@@ -417,7 +690,8 @@ namespace boot {
 			return firmwareDownloader_.expectedWriteLocation();
 		}
 
-		bool & stalled() {return stall_;}
+		[[nodiscard]]
+		bool creditOutstanding() const { return firmwareDownloader_.credit_outstanding(); }
 
 		[[nodiscard]]
 		Status status() const { return status_; }
@@ -426,16 +700,24 @@ namespace boot {
 
 		WriteStatus write(std::uint32_t address, std::uint32_t const data) {
 			assert(firmwareDownloader_.data_expected());
-			auto const ret = firmwareDownloader_.check_and_write(address, data);
-			if (firmwareDownloader_.expectedSize() == firmwareDownloader_.actualSize())
-				canManager.SendDataAck(address, boot::WriteStatus::Ok);
-			return ret;
+			return firmwareDownloader_.check_and_write(address, data);
+		}
+
+		WriteStatus write(std::uint32_t address, std::span<std::uint32_t const> const data) {
+			assert(firmwareDownloader_.data_expected());
+			return firmwareDownloader_.check_and_write(address, data);
+		}
+
+		void request_data_restart() { firmwareDownloader_.request_restart(); }
+
+		WriteStatus write_stream(unsigned const sequence, std::span<std::uint32_t const> const data) {
+			return firmwareDownloader_.stream_write(sequence, data);
 		}
 
 		HandshakeResponse setNewVectorTable(std::uint32_t isr_vector);
 		HandshakeResponse processHandshake(Register reg, Command command, std::uint32_t value);
 		void processHandshakeAck(HandshakeResponse response);
-		bool processDataAck(Bootloader_WriteResult result);
+		bool processDataAck(std::uint32_t address, Bootloader_WriteResult result, std::uint16_t credit);
 
 		Bootloader_Handshake_t processYield();
 		static HandshakeResponse validateVectorTable(AddressSpace expected_space, std::uint32_t address);
@@ -478,8 +760,6 @@ namespace boot {
 		}
 
 		constexpr Bootloader_Handshake_t transactionMagic = create(Register::TransactionMagic, Command::None, Bootloader::transactionMagic);
-		constexpr Bootloader_Handshake_t stall = create(Register::Command, Command::StallSubtransaction, 0);
-		constexpr Bootloader_Handshake_t resume = create(Register::Command, Command::ResumeSubtransaction, 0);
 		constexpr auto abort = [](AbortCode abort_code, std::uint32_t aux_code = 0) {
 			return create(Register::Command, Command::AbortTransaction, aux_code << 8 | static_cast<std::uint32_t>(abort_code));
 		};
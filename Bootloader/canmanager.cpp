@@ -1,9 +1,14 @@
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <bit>
+#include <cstring>
 
 #include "canmanager.hpp"
 #include "options.hpp"
 #include "bootloader.hpp"
+#include "tx_frame_queue.hpp"
 
 #include <ufsel/assert.hpp>
 #include <ufsel/time.hpp>
@@ -32,6 +37,7 @@ namespace boot {
 			case boot::WriteStatus::Ok:
 			case boot::WriteStatus::InsufficientData:
 			case boot::WriteStatus::AlreadyWritten:
+			case boot::WriteStatus::Staged:
 				return Bootloader_WriteResult_Ok;
 
 			case boot::WriteStatus::DiscontinuousWriteAccess:
@@ -42,62 +48,107 @@ namespace boot {
 			assert_unreachable();
 		}
 
-		inline std::array<uint8_t, 1024 * 4> tx_buf[bsp::can::num_used_buses];
+		// Frames are queued in two priority classes per bus. Control traffic (handshakes and their acknowledgements,
+		// aborts, beacons, ...) always leaves before the bulk traffic (Data frames of the firmware readout), hence
+		// it never waits behind the whole backlog of data, only behind frames already placed in the mailboxes.
+		struct TxQueues {
+			// About 4 KiB per bus
+			TxFrameQueue<bsp::can::MessageData, std::bit_ceil(4 * 1024 / sizeof(bsp::can::MessageData))> bulk;
+			TxFrameQueue<bsp::can::MessageData, 16> control;
+		};
+		constinit inline std::array<TxQueues, bsp::can::num_used_buses> tx_queues;
 
-		consteval auto initialize_tx_ringbuffers() {
-			std::array<ringbuf_t, bsp::can::num_used_buses> result;
+		// Data frames are the only bulk traffic sent by the bootloader
+		constexpr bool is_bulk_traffic(CAN_ID_t const id) { return id == Bootloader_Data_id; }
 
-			for (std::size_t i = 0; i < bsp::can::num_used_buses; ++i)
-				result[i] = ringbuf_t{.data = tx_buf[i].data(), .size = tx_buf[i].size(), .readpos = 0, .writepos = 0};
+		// Moves queued frames to free mailboxes, control frames first. All free mailboxes are filled in a single batch.
+		// Called from the main loop, right after a frame is queued and from the transmit interrupt.
+		// Interrupts are masked meanwhile, so that there is always a single consumer
+		inline void process_tx_fifo(bsp::can::bus_info_t const& bus_info) {
+			auto & queues = tx_queues[bus_info.bus_index];
+			auto * const peripheral = bus_info.get_peripheral();
 
-			return result;
+			std::uint32_t const primask = __get_PRIMASK();
+			__disable_irq();
+			std::size_t const free_mailboxes = bsp::can::empty_mailbox_count(peripheral);
+			std::size_t const control_count = std::min(free_mailboxes, queues.control.size());
+			std::size_t const bulk_count = std::min(free_mailboxes - control_count, queues.bulk.size());
+
+			std::array<bsp::can::MessageData const*, bsp::can::tx_mailbox_count> batch;
+			assert(control_count + bulk_count <= size(batch));
+			for (std::size_t i = 0; i < control_count; ++i)
+				batch[i] = &queues.control.at(i);
+			for (std::size_t i = 0; i < bulk_count; ++i)
+				batch[control_count + i] = &queues.bulk.at(i);
+
+			bsp::can::write_messages_for_transmission(bus_info, std::span{batch.data(), control_count + bulk_count});
+			queues.control.pop(control_count);
+			queues.bulk.pop(bulk_count);
+			__set_PRIMASK(primask);
 		}
+	} // end anonymous namespace
 
-		constinit inline std::array<ringbuf_t, bsp::can::num_used_buses> tx_rb = initialize_tx_ringbuffers();
+	bool decode_bulk_data(std::uint8_t const * const bytes, std::size_t const length, BulkData & data_out) {
+		constexpr std::size_t address_length = sizeof(std::uint32_t);
+		// Classic Data frames are handled by CANdb. Bulk frames carry at least two words and no partial words
+		if (length <= CAN_MESSAGE_SIZE || (length - address_length) % sizeof(std::uint32_t) != 0)
+			return false;
 
-		struct tx_fifo_message_header {
-			CAN_ID_t id;
-			uint8_t length;
+		auto const read_word = [bytes](std::size_t offset) -> std::uint32_t {
+			return bytes[offset] | bytes[offset + 1] << 8 | bytes[offset + 2] << 16 | bytes[offset + 3] << 24;
 		};
-		static_assert(sizeof(tx_fifo_message_header) == 8);
-
-		inline void process_tx_fifo(bsp::can::bus_info_t const& bus_info) {
-			ringbuf_t & rb = tx_rb[bus_info.bus_index];
-			auto * const peripheral = bus_info.get_peripheral();
 
-			// As long as there is pending data in the rx buffer, but do not allow more than some specified number
-			while (rb.readpos != rb.writepos && bsp::can::has_empty_mailbox(peripheral)) {
-				size_t read_pos = rb.readpos;
+		data_out.word_count = (length - address_length) / sizeof(std::uint32_t);
+		if (data_out.word_count > BulkData::max_words)
+			return false;
 
-				// Read message header & data. The message in the rx buffer may not yet be complete,
-				// in that case we abort and try again next time.
-				tx_fifo_message_header hdr;
-				bool const header_ok = ringbufTryRead(&rb, (uint8_t*) &hdr, sizeof(hdr), &read_pos) == sizeof(hdr);
-				assert(header_ok); //well, what else do we have..
+		// Same encoding as Bootloader_Data_t::Address - word aligned address with two spare top bits
+		data_out.address = (read_word(0) & ufsel::bit::bitmask_of_width(30)) << 2;
+		for (std::size_t i = 0; i < data_out.word_count; ++i)
+			data_out.words[i] = read_word(address_length + i * sizeof(std::uint32_t));
+		return true;
+	}
 
-				bsp::can::MessageData message {.id = hdr.id, .length = hdr.length};
+	static_assert((StreamData::first_id & bsp::can::filter::mustMatch) == bsp::can::filter::streamPrefix, "Stream data must pass the hardware filter.");
+	static_assert(StreamData::sequence_modulus == (~bsp::can::filter::mustMatch & ufsel::bit::bitmask_of_width(11)) + 1, "Sequence number must use all bits ignored by the filter.");
 
-				bool const message_ok = ringbufTryRead(&rb, (std::uint8_t*)message.data.data(), hdr.length, &read_pos) == hdr.length;
-				assert(message_ok); //well, what else do we have..
+	bool decode_stream_data(CAN_ID_t const id, std::uint8_t const * const bytes, std::size_t const length, StreamData & data_out) {
+		if (!StreamData::is_stream_id(id) || length == 0 || length % sizeof(std::uint32_t) != 0)
+			return false;
 
-				rb.readpos = read_pos;
+		data_out.word_count = length / sizeof(std::uint32_t);
+		if (data_out.word_count > StreamData::max_words)
+			return false;
 
-				bsp::can::write_message_for_transmission(bus_info, message);
-			}
+		data_out.sequence = id - StreamData::first_id;
+		for (std::size_t i = 0; i < data_out.word_count; ++i) {
+			std::uint8_t const * const word = bytes + i * sizeof(std::uint32_t);
+			data_out.words[i] = word[0] | word[1] << 8 | word[2] << 16 | word[3] << 24;
 		}
-	} // end anonymous namespace
+		return true;
+	}
 
 	void process_all_tx_fifos() {
 		for (auto const& bus : bsp::can::bus_info)
 			process_tx_fifo(bus);
 	}
 
-	int CanManager::get_tx_buffer_size() {
+	bsp::can::bus_info_t const& CanManager::data_bus() const {
+		if (bootloader.stripedTransfer())
+			return bsp::can::bus_info[next_data_bus_index_ % bsp::can::num_used_buses];
+
 		candb_bus_t const bus_id = Bootloader_Handshake_get_rx_bus();
 		assert(bus_id != bus_UNDEFINED);
 		assert(bus_id != bus_ALL);
-		bsp::can::bus_info_t const& bus_info = bsp::can::find_bus_info_by_bus(bus_id);
-		return ringbufSize(&tx_rb[bus_info.bus_index]);
+		return bsp::can::find_bus_info_by_bus(bus_id);
+	}
+
+	std::size_t CanManager::bus_count() {
+		return bsp::can::num_used_buses;
+	}
+
+	std::size_t CanManager::get_tx_queue_free_space() {
+		return tx_queues[data_bus().bus_index].bulk.free_space();
 	}
 
 	void CanManager::SendSoftwareBuild() {
@@ -119,21 +170,49 @@ namespace boot {
 			set_pending_abort_request(handshake::abort(AbortCode::CanSendFailedExitAck));
 	}
 
-	void CanManager::SendData(std::uint32_t address, std::uint32_t word) {
-		Bootloader_Data_t message;
+	void CanManager::SendData(std::uint32_t const address, std::uint32_t const word) {
+		SendData(address, std::span{&word, 1});
+	}
 
-		message.Address = address >> 2;
-		message.Word = word;
+	void CanManager::SendData(std::uint32_t const address, std::span<std::uint32_t const> const words) {
+		assert(!words.empty() && words.size() <= BulkData::max_words);
+
+		// Layout of Bootloader_Data_t (the address may be followed by more words). Encoded here instead of CANdb,
+		// because the frame may be sent over any bus, not only over the one CANdb assigns to Data
+		std::array<std::uint8_t, sizeof(std::uint32_t) * (BulkData::max_words + 1)> buffer;
+		auto const write_word = [&buffer](std::size_t const offset, std::uint32_t const word) {
+			buffer[offset] = word;
+			buffer[offset + 1] = word >> 8;
+			buffer[offset + 2] = word >> 16;
+			buffer[offset + 3] = word >> 24;
+		};
 
-		if (send(message))
+		write_word(0, address >> 2 & ufsel::bit::bitmask_of_width(30));
+		for (std::size_t i = 0; i < words.size(); ++i)
+			write_word((i + 1) * sizeof(std::uint32_t), words[i]);
+
+		if (txSendCANMessage(data_bus().candb_bus, Bootloader_Data_id, buffer.data(), (words.size() + 1) * sizeof(std::uint32_t)))
 			set_pending_abort_request(handshake::abort(AbortCode::CanSendFailedData));
+		else
+			++next_data_bus_index_;
+	}
+
+	std::size_t CanManager::data_frame_capacity(std::size_t const words) const {
+#if defined BOOT_STM32G4
+		if (data_bus().fd_frame)
+			for (std::size_t count = std::min(words, BulkData::max_words); count > 1; --count)
+				if (bsp::can::length_to_DLC((count + 1) * sizeof(std::uint32_t)).has_value())
+					return count;
+#endif
+		return std::min<std::size_t>(words, 1);
 	}
 
-	void CanManager::SendDataAck(std::uint32_t const address, WriteStatus const status) {
+	void CanManager::SendDataAck(std::uint32_t const address, WriteStatus const status, std::uint16_t const credit) {
 		Bootloader_DataAck_t message;
 
 		message.Address = address >> 2;
 		message.Result = toCan(status);
+		message.Credit = credit;
 
 		if (send(message))
 			set_pending_abort_request(handshake::abort(AbortCode::CanSendFailedDataAck));
@@ -197,6 +276,21 @@ namespace boot {
 		SendHandshake(handshake::create(Register::Command, Command::RestartFromAddress, address));
 	}
 
+	void CanManager::RetransmitWords(std::uint32_t const address, std::uint32_t const following) {
+		assert(following <= ufsel::bit::bitmask_of_width(retransmit::bitmap_width));
+		std::uint32_t const offset = (address - customization::flashMemoryBaseAddress) / sizeof(std::uint32_t);
+		SendHandshake(handshake::create(Register::Command, Command::RetransmitWord, offset | following << retransmit::offset_bits));
+	}
+
+	void CanManager::set_pending_abort_request(Bootloader_Handshake_t const abort_request) {
+		assert(abort_request.Command == Bootloader_Command_AbortTransaction);
+		// Control frames bypass the queued data, hence the abort is usually sent right away. Only if even the control
+		// queue is full, it is retried from the main loop. Interrupt handlers (e.g. rx buffer overflow) must not
+		// queue frames themselves, the queues have a single producer in thread mode
+		if (__get_IPSR() != 0 || send(abort_request) != 0)
+			pending_abort_request_ = abort_request;
+	}
+
 	void CanManager::update() {
 		if (pending_abort_request_.has_value())
 			if (send(*pending_abort_request_) == 0)
@@ -205,6 +299,12 @@ namespace boot {
 
 } // end namespace boot
 
+namespace bsp::can {
+	void transmit_mailbox_empty(bus_info_t const& bus) {
+		boot::process_tx_fifo(bus);
+	}
+}
+
 /* Implementation of function required by tx library.
    These functions must use C linkage, because they are used by the code generated from CANdb (which is pure C). */
 
@@ -223,7 +323,27 @@ uint32_t txGetTimeMillis() {
 }
 
 int txHandleCANMessage(uint32_t timestamp, int bus, CAN_ID_t id, const void* data, size_t length) {
-	return 0; //all messages are filtered by hardware
+	//all messages are filtered by hardware
+	if (boot::StreamData::is_stream_id(id)) {
+		// Stream data are not described in CANdb, keep them away from it
+		boot::StreamData stream_data;
+		if (!boot::decode_stream_data(id, static_cast<std::uint8_t const*>(data), length, stream_data))
+			txHandleError(TX_LENGTH_MISMATCH, bus, id, data, length);
+		else
+			boot::canManager.handle_stream_data(stream_data);
+		return -1;
+	}
+
+	if (id != Bootloader_Data_id || length <= CAN_MESSAGE_SIZE)
+		return 0;
+
+	// CAN FD Data frames would be rejected by CANdb's length check. Dispatch them here and keep them away from CANdb
+	boot::BulkData bulk_data;
+	if (!boot::decode_bulk_data(static_cast<std::uint8_t const*>(data), length, bulk_data))
+		txHandleError(TX_LENGTH_MISMATCH, bus, id, data, length);
+	else
+		boot::canManager.handle_bulk_data(bulk_data);
+	return -1;
 }
 
 int txSendCANMessage(int const bus, CAN_ID_t const id, const void* const data, size_t const length) {
@@ -238,16 +358,25 @@ int txSendCANMessage(int const bus, CAN_ID_t const id, const void* const data, s
 	assert(bus != bus_ALL);
 	auto const& bus_info = bsp::can::find_bus_info_by_bus((candb_bus_t)bus);
 
-	const size_t required_size = sizeof(struct CAN_msg_header) + length;
-
-	ringbuf_t & rb = boot::tx_rb[bus_info.bus_index];
-	//TODO handle case when peripherals are not receiving acknowledges!
-	if (!ringbufCanWrite(&rb, required_size))
-		return 1;
-
-	boot::tx_fifo_message_header hdr{ .id = id, .length = (uint8_t)length};
-	ringbufWriteUnchecked(&rb, (const uint8_t*) &hdr, sizeof(hdr));
-	ringbufWriteUnchecked(&rb, (const uint8_t*) data, length);
+	auto & queues = boot::tx_queues[bus_info.bus_index];
+	auto const enqueue = [&](auto & queue) {
+		//TODO handle case when peripherals are not receiving acknowledges!
+		if (queue.free_space() == 0)
+			return 1;
+
+		bsp::can::MessageData & frame = queue.back();
+		assert(length <= sizeof(frame.data));
+		frame.id = id;
+		frame.length = length;
+		std::memcpy(frame.data.data(), data, length);
+		queue.push();
+		return 0;
+	};
+	if (int const rc = boot::is_bulk_traffic(id) ? enqueue(queues.bulk) : enqueue(queues.control); rc != 0)
+		return rc;
+
+	// Don't wait for the main loop if a mailbox is free. Otherwise the transmit interrupt picks the frame up
+	boot::process_tx_fifo(bus_info);
 
 	return 0;
 }
@@ -11,29 +11,95 @@
 #include "flash.hpp"
 #include "enums.hpp"
 
+#include <BSP/can.hpp>
+#include <BSP/fdcan.hpp>
+
 #include <optional>
+#include <array>
+#include <span>
 
 namespace boot {
 
 	void process_all_tx_fifos();
 
+	// Variable length variant of Bootloader::Data received over CAN FD. It shares the identifier and the layout
+	// with Bootloader::Data, but the word aligned address is followed by up to 15 contiguous words of data.
+	struct BulkData {
+		constexpr static std::size_t max_words = 15;
+
+		std::uint32_t address;
+		std::size_t word_count;
+		std::array<std::uint32_t, max_words> words;
+
+		[[nodiscard]] std::span<std::uint32_t const> data() const { return std::span{words.data(), word_count}; }
+	};
+
+	// Returns true iff given payload is a valid CAN FD Data frame (longer than classic Bootloader::Data)
+	bool decode_bulk_data(std::uint8_t const * bytes, std::size_t length, BulkData & data_out);
+
+	// Value of command RetransmitWord - negative acknowledgement of lost words. The lower bits carry the word offset
+	// of the first missing word from the start of flash, the upper bits a bitmap of missing words following it
+	// (bit i selects the (i + 1)-th following word of the firmware in order of the logical memory map)
+	namespace retransmit {
+		constexpr int offset_bits = 19;
+		constexpr int bitmap_width = 32 - offset_bits;
+		static_assert(end(physicalMemoryBlocks[physicalMemoryBlocks.size() - 1]) - customization::flashMemoryBaseAddress <= (std::uint32_t{1} << offset_bits) * sizeof(std::uint32_t),
+			"Word offset of every flash address must fit in the lower bits.");
+	}
+
+	// Addressless data received while the data stream is open (see Command::OpenDataStream). The frame carries
+	// only contiguous words of data, the lowest bits of its identifier (0x630-0x637) carry rolling sequence number.
+	struct StreamData {
+		constexpr static CAN_ID_t first_id = STD_ID(0x630);
+		constexpr static unsigned sequence_modulus = 8;
+		constexpr static std::size_t max_words = 16;
+
+		unsigned sequence;
+		std::size_t word_count;
+		std::array<std::uint32_t, max_words> words;
+
+		[[nodiscard]] static bool is_stream_id(CAN_ID_t const id) { return id >= first_id && id < first_id + sequence_modulus; }
+		[[nodiscard]] std::span<std::uint32_t const> data() const { return std::span{words.data(), word_count}; }
+	};
+
+	// Returns true iff given payload is a valid frame of the data stream
+	bool decode_stream_data(CAN_ID_t id, std::uint8_t const * bytes, std::size_t length, StreamData & data_out);
+
 	class CanManager {
 
 		Bootloader_Handshake_t lastSentHandshake_;
 
 		std::optional<Bootloader_Handshake_t> pending_abort_request_;
 
+		// Index into bsp::can::bus_info of the bus carrying the next Data frame of a striped transfer (round robin)
+		std::size_t next_data_bus_index_ = 0;
+		// Bus the next Data frame is sent on
+		[[nodiscard]] bsp::can::bus_info_t const& data_bus() const;
+
+		int (*bulk_data_callback_)(BulkData const * data) = nullptr;
+		int (*stream_data_callback_)(StreamData const * data) = nullptr;
+
 	public:
-		void set_pending_abort_request(Bootloader_Handshake_t abort_request) {
-			assert(abort_request.Command == Bootloader_Command_AbortTransaction);
-			pending_abort_request_ = abort_request;
-		}
+		// Registers the handler of CAN FD Data frames. Mirrors Bootloader_Data_on_receive generated by CANdb
+		void BulkData_on_receive(int (*callback)(BulkData const* data)) { bulk_data_callback_ = callback; }
+		int handle_bulk_data(BulkData const& data) { return bulk_data_callback_ ? bulk_data_callback_(&data) : 2; }
+		void StreamData_on_receive(int (*callback)(StreamData const* data)) { stream_data_callback_ = callback; }
+		int handle_stream_data(StreamData const& data) { return stream_data_callback_ ? stream_data_callback_(&data) : 2; }
+
+		// Sends the abort request immediately if possible, otherwise keeps it and retries from update()
+		void set_pending_abort_request(Bootloader_Handshake_t abort_request);
 
 		void SendSoftwareBuild();
 		void SendBeacon(Status const BLstate, EntryReason const entryReason);
 
 		void SendData(std::uint32_t address, std::uint32_t word);
-		void SendDataAck(std::uint32_t address, WriteStatus result);
+		// Sends contiguous words in a single Data frame (CAN FD frame if more than one word).
+		// Data frames of a striped transfer are sent over all buses in turns, otherwise over the bus used by the master
+		void SendData(std::uint32_t address, std::span<std::uint32_t const> words);
+		// Number of words (at most the given count) that can be sent in the next Data frame (depends on its bus).
+		// CAN FD buses carry up to BulkData::max_words (limited to counts matching valid FD frame lengths), others one word
+		[[nodiscard]] std::size_t data_frame_capacity(std::size_t words) const;
+		void SendDataAck(std::uint32_t address, WriteStatus result, std::uint16_t credit = 0);
 		void SendExitAck(bool exitPossible);
 		void SendPingResponse(bool entering_bl);
 		void SendHandshakeAck(Register reg, HandshakeResponse response, std::uint32_t val);
@@ -42,12 +108,19 @@ namespace boot {
 		void yieldCommunication();
 
 		void RestartDataFrom(std::uint32_t address);
+		// Requests the word at given address and the following ones selected by the bitmap (see retransmit)
+		void RetransmitWords(std::uint32_t address, std::uint32_t following);
 
 		Bootloader_Handshake_t const& lastSentHandshake() const { return lastSentHandshake_;}
 
 		void update();
 
-		int get_tx_buffer_size();
+		// Number of Data frames that can be queued for transmission on the bus of the next Data frame.
+		// Control frames have a separate queue, which is not affected by queued data
+		std::size_t get_tx_queue_free_space();
+
+		// Number of buses used by the bootloader (Data frames of striped transfers are spread over all of them)
+		[[nodiscard]] static std::size_t bus_count();
 	};
 
 	inline CanManager canManager;
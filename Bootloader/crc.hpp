@@ -0,0 +1,62 @@
+/*
+ * eForce CAN Bootloader
+ *
+ * Written by Vojtěch Michal
+ *
+ * Copyright (c) 2020 eforce FEE Prague Formula
+ */
+
+#pragma once
+
+#include "flash.hpp"
+#include "crc_feed.hpp"
+
+#include <ufsel/bit.hpp>
+
+#include <cstdint>
+#include <span>
+
+namespace boot {
+
+	// CRC-32 computed by the STM32 CRC peripheral in its default configuration (polynomial 0x04C11DB7,
+	// initial value 0xFFFFFFFF, data fed by 32 bit words MSB first, no reflection and no final xor).
+	// The state is kept by the peripheral, hence only one computation may be in progress at a time.
+	class Crc32 {
+	public:
+		static void reset() {
+#if defined BOOT_STM32F1
+			ufsel::bit::set(std::ref(RCC->AHBENR), RCC_AHBENR_CRCEN);
+#elif defined BOOT_STM32F2 || defined BOOT_STM32F4 || defined BOOT_STM32F7 || defined BOOT_STM32G4
+			ufsel::bit::set(std::ref(RCC->AHB1ENR), RCC_AHB1ENR_CRCEN);
+#else
+#error "This MCU is not supported"
+#endif
+			CRC->CR = CRC_CR_RESET;
+		}
+
+		static void update(std::uint32_t const word) { CRC->DR = word; }
+
+		[[nodiscard]] static std::uint32_t value() { return CRC->DR; }
+
+		// Digest of the given block of flash memory
+		[[nodiscard]] static std::uint32_t of(MemoryBlock const& block) {
+			reset();
+			feed(block);
+			return value();
+		}
+
+		// Digest of the given blocks of flash memory concatenated in the given order
+		[[nodiscard]] static std::uint32_t of(std::span<MemoryBlock const> const blocks) {
+			reset();
+			for (MemoryBlock const& block : blocks)
+				feed(block);
+			return value();
+		}
+
+	private:
+		static void feed(MemoryBlock const& block) {
+			feed_words(reinterpret_cast<std::uint32_t const *>(block.address), block.length / sizeof(std::uint32_t), update);
+		}
+	};
+
+}
@@ -0,0 +1,32 @@
+/*
+ * eForce CAN Bootloader
+ *
+ * Written by Vojtech Michal
+ *
+ * Copyright (c) 2020, 2021 eforce FEE Prague Formula
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace boot {
+
+	// Passes the given words to update in order. The loop is unrolled by four words, so that the CRC unit is fed
+	// back to back rather than waiting for the loop control; the remaining words (count not a multiple of four)
+	// are fed one by one.
+	template<typename Update>
+	void feed_words(std::uint32_t const * words, std::size_t const count, Update && update) {
+		std::uint32_t const * const end = words + count;
+		for (; end - words >= 4; words += 4) {
+			update(words[0]);
+			update(words[1]);
+			update(words[2]);
+			update(words[3]);
+		}
+		for (; words != end; ++words)
+			update(*words);
+	}
+
+}
@@ -0,0 +1,112 @@
+/*
+ * eForce CAN Bootloader
+ *
+ * Written by Vojtěch Michal
+ *
+ * Copyright (c) 2020 eforce FEE Prague Formula
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <array>
+
+namespace boot {
+
+	// Streaming decompressor of the heatshrink format (LZSS) with 256 byte window and 16 byte lookahead
+	// (heatshrink -w 8 -l 4). The compressed stream is a sequence of bits (MSB first) consisting of tokens:
+	//   1 + 8 bits of literal byte
+	//   0 + 8 bits of (offset - 1) + 4 bits of (length - 1) - copy of previously decompressed bytes
+	// Decompression requires no RAM besides the window, the input can be fed byte by byte.
+	class Decompressor {
+	public:
+		constexpr static int window_bits = 8, count_bits = 4;
+
+	private:
+		enum class State {
+			tag,
+			literal,
+			backref_index,
+			backref_count,
+		};
+
+		std::array<std::uint8_t, 1 << window_bits> window_;
+		std::uint32_t head_ = 0; // Number of decompressed bytes (modulo window size gives position in the window)
+
+		State state_ = State::tag;
+		std::uint32_t bits_ = 0; // Bits of the currently decoded field
+		int bit_count_ = 0; // Number of bits stored in bits_
+		std::uint32_t backref_offset_ = 0;
+
+		// Accumulates bits of a field. Returns true once it has the required width
+		bool accumulate(int const bit, int const width) {
+			bits_ = bits_ << 1 | bit;
+			if (++bit_count_ < width)
+				return false;
+			bit_count_ = 0;
+			return true;
+		}
+
+		template<typename Output>
+		bool emit(std::uint8_t const byte, Output & output) {
+			window_[head_++ % size(window_)] = byte;
+			return output(byte);
+		}
+
+	public:
+		Decompressor() { reset(); }
+
+		void reset() {
+			window_.fill(0); // Heatshrink assumes the window initially filled with zeros
+			head_ = 0;
+			state_ = State::tag;
+			bits_ = 0;
+			bit_count_ = 0;
+			backref_offset_ = 0;
+		}
+
+		// Feeds single byte of the compressed stream. For every decompressed byte calls output(byte), which returns
+		// false to stop the decompression. Returns false iff the output callback requested stop.
+		template<typename Output>
+		bool feed(std::uint8_t const byte, Output && output) {
+			for (int bit_index = 7; bit_index >= 0; --bit_index) {
+				int const bit = byte >> bit_index & 1;
+
+				switch (state_) {
+				case State::tag:
+					state_ = bit ? State::literal : State::backref_index;
+					bits_ = 0;
+					break;
+
+				case State::literal:
+					if (!accumulate(bit, 8))
+						break;
+					state_ = State::tag;
+					if (!emit(static_cast<std::uint8_t>(bits_), output))
+						return false;
+					break;
+
+				case State::backref_index:
+					if (!accumulate(bit, window_bits))
+						break;
+					backref_offset_ = bits_ + 1;
+					bits_ = 0;
+					state_ = State::backref_count;
+					break;
+
+				case State::backref_count: {
+					if (!accumulate(bit, count_bits))
+						break;
+					state_ = State::tag;
+					for (std::uint32_t count = bits_ + 1; count > 0; --count)
+						if (!emit(window_[(head_ - backref_offset_) % size(window_)], output))
+							return false;
+					break;
+				}
+				}
+			}
+			return true;
+		}
+	};
+
+}
@@ -26,6 +26,7 @@ namespace boot {
 		PhysicalBlockStart = Bootloader_Register_PhysicalBlockStart,
 		PhysicalBlockLength = Bootloader_Register_PhysicalBlockLength,
 		Command = Bootloader_Register_Command,
+		Argument = Bootloader_Register_Argument,
 	};
 
 	enum class Command {
@@ -39,6 +40,12 @@ namespace boot {
 		StartBootloaderUpdate = Bootloader_Command_StartBootloaderUpdate,
 		StartFirmwareReadout = Bootloader_Command_StartFirmwareReadout,
 		StartBootloaderReadout = Bootloader_Command_StartBootloaderReadout,
+		OpenDataStream = Bootloader_Command_OpenDataStream,
+		RetransmitWord = Bootloader_Command_RetransmitWord,
+		OpenCompressedDataStream = Bootloader_Command_OpenCompressedDataStream,
+		CopyFromOldFirmware = Bootloader_Command_CopyFromOldFirmware,
+		SkipErasedData = Bootloader_Command_SkipErasedData,
+		Fill = Bootloader_Command_Fill,
 	};
 
 	enum class HandshakeResponse {
@@ -72,6 +79,9 @@ namespace boot {
 		MustBeNonZero = Bootloader_HandshakeResponse_MustBeNonZero,
 		PageEraseFailed = Bootloader_HandshakeResponse_PageEraseFailed,
 		BufferTransferFailed = Bootloader_HandshakeResponse_BufferTransferFailed,
+		PatchSourceInvalid = Bootloader_HandshakeResponse_PatchSourceInvalid,
+		PageUnchanged = Bootloader_HandshakeResponse_PageUnchanged,
+		BlocksPendingRepair = Bootloader_HandshakeResponse_BlocksPendingRepair,
 	};
 
 	/*
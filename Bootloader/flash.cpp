@@ -3,6 +3,7 @@
 #include <ufsel/bit.hpp>
 
 #include <ufsel/assert.hpp>
+#include <utility>
 
 namespace boot {
 
@@ -38,6 +39,13 @@ namespace boot {
 		ufsel::bit::wait_until_cleared(FLASH->SR, FLASH_SR_BSY);
 	}
 
+	std::uint32_t Flash::FinishOperation() {
+		AwaitEndOfOperation();
+		std::uint32_t const result = FLASH->SR;
+		ClearProgrammingErrors();
+		return result;
+	}
+
 	void Flash::ClearProgrammingErrors() {
 #if defined BOOT_STM32G4
 		ufsel::bit::set(std::ref(FLASH->SR),
@@ -56,21 +64,19 @@ namespace boot {
 #endif
 	}
 
-	std::uint32_t Flash::ErasePage(std::uint32_t pageAddress) {
+	void Flash::StartErasePage(std::uint32_t pageAddress) {
 		using namespace ufsel;
 #if defined BOOT_STM32F1
 
-		AwaitEndOfOperation();
-		ClearProgrammingErrors();
+		pendingErrors_ = FinishOperation(); // Errors of the preceding write must not get lost
 
+		ufsel::bit::clear(std::ref(FLASH->CR), FLASH_CR_PG); // Leave programming mode entered by Write
 		ufsel::bit::set(std::ref(FLASH->CR), FLASH_CR_PER);
 		FLASH->AR = pageAddress;
 		ufsel::bit::set(std::ref(FLASH->CR), FLASH_CR_STRT);
-		return FLASH->SR;
 #elif defined BOOT_STM32G4
 
-		AwaitEndOfOperation();
-		ClearProgrammingErrors();
+		pendingErrors_ = FinishOperation(); // Errors of the preceding write must not get lost
 
 		auto const page_id = getEnclosingBlockId(pageAddress);
 		bit::sliceable_reference CR{FLASH->CR};
@@ -79,32 +85,38 @@ namespace boot {
 		CR[bit::slice::for_mask(FLASH_CR_PNB)] = page_id.block_index;
 		CR[FLASH_CR_BKER_Pos] = page_id.bank_num;
 		CR[FLASH_CR_STRT_Pos] = true; // start page erase
-		AwaitEndOfOperation();
-		return FLASH->SR;
 #elif defined BOOT_STM32F4 || defined BOOT_STM32F7 || defined BOOT_STM32F2
 
-		AwaitEndOfOperation();
-		ClearProgrammingErrors();
+		pendingErrors_ = FinishOperation(); // Errors of the preceding write must not get lost
 
 		//configure write paralelism based on voltage range, use 32bit paralellism (0b10)
 		ufsel::bit::modify(std::ref(FLASH->CR), ufsel::bit::bitmask_of_width(2), 0b10, POS_FROM_MASK(FLASH_CR_PSIZE));
 
 		unsigned const sectorIndex = Flash::getEnclosingBlockId(pageAddress).block_index;
 
+		ufsel::bit::clear(std::ref(FLASH->CR), FLASH_CR_PG); // Leave programming mode entered by Write
 		assert(ufsel::bit::all_cleared(FLASH->CR, FLASH_CR_MER, FLASH_CR_PG));
 		FLASH->CR |= FLASH_CR_SER; //Choose sector erase.
 		//FLASH_CR_SNB is 5 bits wide on f767, but the highest bit is always 0, so it is enough to write only lower four bits.
 		ufsel::bit::modify(std::ref(FLASH->CR), ufsel::bit::bitmask_of_width(4), sectorIndex, POS_FROM_MASK(FLASH_CR_SNB));
 		FLASH->CR |= FLASH_CR_STRT; //Start the operation
-
-		AwaitEndOfOperation();
-		FLASH->CR &= ~FLASH_CR_SER; //disable sector erase flag
-
-		return FLASH->SR;
 #else
 #error "This MCU is not supported"
 #endif
-}
+	}
+
+	std::uint32_t Flash::FinishErasePage() {
+		assert(!Busy());
+		std::uint32_t const result = FLASH->SR | std::exchange(pendingErrors_, 0);
+		AwaitEndOfErasure(); // Deselect erase, so that programming is possible
+		return result;
+	}
+
+	std::uint32_t Flash::ErasePage(std::uint32_t pageAddress) {
+		StartErasePage(pageAddress);
+		AwaitEndOfOperation();
+		return FinishErasePage();
+	}
 
 	WriteStatus Flash::Write(std::uint32_t address, nativeType data) {
 		assert(address % sizeof(nativeType) == 0 && "Attempt to perform unaligned write!");
@@ -132,9 +144,7 @@ namespace boot {
 		return ufsel::bit::all_cleared(cachedResult, FLASH_SR_PGSERR, FLASH_SR_PGPERR, FLASH_SR_PGAERR, FLASH_SR_WRPERR) ? WriteStatus::Ok : WriteStatus::OtherError;
 #elif defined BOOT_STM32G4
 		static_assert(std::is_same_v<nativeType, std::uint64_t>, "STM32G4 flash must be written with 64 bit granularity.");
-		AwaitEndOfOperation();
-		std::uint32_t const cachedResult = FLASH->SR;
-		ClearProgrammingErrors();
+		std::uint32_t const cachedResult = FinishOperation();
 
 		ufsel::bit::set(std::ref(FLASH->CR), FLASH_CR_PG); //Start flash programming
 
@@ -142,8 +152,8 @@ namespace boot {
 		ufsel::bit::access_register<std::uint32_t>(address) = data; //Write lower word of data
 		ufsel::bit::access_register<std::uint32_t>(address + 4) = data >> 32; //Write higher word of data
 
-		AwaitEndOfOperation(); // Wait for end of programming
-
+		// Don't wait for end of programming, the next flash operation does. Errors are reported by the following write
+		// (or by CommitRow, which waits for the last one)
 		return ufsel::bit::all_cleared(cachedResult, FLASH_SR_SIZERR, FLASH_SR_PGSERR, FLASH_SR_PROGERR, FLASH_SR_PGAERR, FLASH_SR_WRPERR) ? WriteStatus::Ok : WriteStatus::OtherError;
 
 #elif defined BOOT_STM32F7
@@ -166,6 +176,58 @@ namespace boot {
 #endif
 	}
 
+	WriteStatus Flash::WriteRow(std::uint32_t const address, Row const& data) {
+		assert(address % rowSize == 0 && "Attempt to program unaligned row!");
+#if defined BOOT_STM32G4
+		static_assert(rowSize == 32 * sizeof(std::uint64_t), "STM32G4 fast programming writes rows of 32 double words.");
+		// Fast programming fails with PGSERR unless the bank has been mass erased. Once that happens, don't try again
+		static bool fast_programming_usable = true;
+		if (!fast_programming_usable)
+			return WriteRowNatively(address, data);
+
+		// The preceding write may still be in progress, its errors belong to it
+		if (!is_SR_ok(FinishOperation()))
+			return WriteStatus::OtherError;
+
+		ufsel::bit::clear(std::ref(FLASH->CR), FLASH_CR_PG);
+		ufsel::bit::set(std::ref(FLASH->CR), FLASH_CR_FSTPG); //Start fast programming
+
+		// The double words must follow each other without delay, otherwise the programming fails with MISSERR
+		std::uint32_t const primask = __get_PRIMASK();
+		__disable_irq();
+		for (std::size_t index = 0; index < size(data); ++index) {
+			ufsel::bit::access_register<std::uint32_t>(address + index * sizeof(nativeType)) = data[index]; //Write lower word of data
+			ufsel::bit::access_register<std::uint32_t>(address + index * sizeof(nativeType) + 4) = data[index] >> 32; //Write higher word of data
+		}
+		__set_PRIMASK(primask);
+
+		AwaitEndOfOperation(); // Wait for end of programming
+		std::uint32_t const result = FLASH->SR;
+		ufsel::bit::clear(std::ref(FLASH->CR), FLASH_CR_FSTPG);
+
+		if (is_SR_ok(result) && ufsel::bit::all_cleared(result, FLASH_SR_MISERR))
+			return WriteStatus::Ok;
+
+		// The row was rejected by fast programming, program it double word by double word instead
+		ClearProgrammingErrors();
+		if (ufsel::bit::all_set(result, FLASH_SR_PGSERR))
+			fast_programming_usable = false;
+		return WriteRowNatively(address, data);
+#elif defined BOOT_STM32F1 || defined BOOT_STM32F2 || defined BOOT_STM32F4 || defined BOOT_STM32F7
+		// These families have no row programming accessible at the supply voltage of our boards, program natively
+		return WriteRowNatively(address, data);
+#else
+#error "This MCU is not supported"
+#endif
+	}
+
+	WriteStatus Flash::WriteRowNatively(std::uint32_t const address, Row const& data) {
+		for (std::size_t index = 0; index < size(data); ++index)
+			if (WriteStatus const status = Write(address + index * sizeof(nativeType), data[index]); status != WriteStatus::Ok)
+				return status;
+		return WriteStatus::Ok;
+	}
+
 	AddressSpace Flash::addressOrigin_located_in_flash(std::uint32_t const address) {
 		if (belongs_to_address_space(address, application))
 			return AddressSpace::ApplicationFlash;
@@ -14,13 +14,16 @@
 #include <ufsel/assert.hpp>
 #include <ufsel/traits.hpp>
 #include "options.hpp"
+#include "flash_write_buffer.hpp"
 
+#include <algorithm>
 #include <span>
 #include <bit>
+#include <bitset>
 #include <cstddef>
 #include <cstdint>
+#include <optional>
 
-#include <CANdb/tx2/ringbuf.h>
 
 namespace boot {
 
@@ -44,65 +47,17 @@ namespace boot {
 		InsufficientData = 7,
 		NotAligned = 8,
 		OtherError = 9,
-	};
-
-	template<typename T>
-	concept WriteableIntegral = ufsel::traits::type_is_one_of_v<T, std::uint16_t, std::uint32_t, std::uint64_t>;
-
-	template<std::size_t CAPACITY>
-	struct FlashWriteBuffer {
-		struct record {
-			std::uint32_t address_;
-			std::uint8_t size_;
-			std::uint64_t data_;
-		};
-
-		constexpr static std::size_t capacity = CAPACITY;
-		record buffer[capacity];
-		ringbuf_t ringbuf {.data = reinterpret_cast<std::uint8_t*>(buffer), .size = CAPACITY, .readpos = 0, .writepos = 0};
-
-		void reset() {
-			ringbuf.readpos = ringbuf.writepos = 0;
-		}
-
-
-		void push(std::uint32_t address, WriteableIntegral auto data, std::size_t const length) {
-			assert(ringbufCanWrite(&ringbuf, sizeof(record)));
-			record const new_record {.address_ = address, .size_ = static_cast<std::uint8_t>(length), .data_ = data};
-			ringbufWrite(&ringbuf, reinterpret_cast<std::uint8_t const*>(&new_record), sizeof(record));
-		}
-
-		[[nodiscard]]
-		record peek(int offset) const {
-			//cannot read anything, since there is not that many elements
-			assert(ringbufSize(&ringbuf) >= (offset + 1) * sizeof(record));
-
-			size_t readpos = (ringbuf.readpos + offset * sizeof(record)) % capacity;
-			record result;
-			ringbufTryRead(&ringbuf, reinterpret_cast<std::uint8_t *>(&result), sizeof(record), &readpos);
-			return result;
-		}
-
-		void pop(int count) {
-			//cannot read anything, since there is not that many elements
-			assert(ringbufSize(&ringbuf) >= count * sizeof(record));
-
-			//advance the read index.
-			ringbuf.readpos = (ringbuf.readpos + count * sizeof(record)) % capacity;
-		}
-
-		[[nodiscard]] std::size_t size() const { return ringbufSize(&ringbuf) / sizeof(record); }
-		[[nodiscard]] bool is_full() const { return !ringbufCanWrite(&ringbuf, sizeof(record)); }
-		[[nodiscard]] bool empty() const { return size() == 0; }
+		Staged = 10, // Received ahead of the expected write location, held in the receive window
 	};
 
 	struct Flash {
 		friend struct ApplicationJumpTable;
-		static inline FlashWriteBuffer<flash_write_buffer_size> writeBuffer_;
 
 		using nativeType = ufsel::traits::uint_of_size_t<customization::flashProgrammingParallelism / 8>;
 		static_assert(std::is_unsigned_v<nativeType>, "Flash native type shall be unsigned to prevent problems with signed overflow.");
 
+		static inline FlashWriteBuffer<nativeType, flash_write_buffer_size> writeBuffer_;
+
 		constexpr static bool pagesHaveSameSize() { return customization::physicalBlockSizePolicy == PhysicalBlockSizes::same; };
 
 		static std::size_t const applicationMemorySize;
@@ -137,10 +92,80 @@ namespace boot {
 		static void AwaitEndOfErasure();
 		static void AwaitEndOfOperation();
 		static std::uint32_t ErasePage(std::uint32_t pageAddress);
+		// Non-blocking erasure: starts the erase and returns immediately. Once the flash is no longer busy,
+		// FinishErasePage deselects the erase and returns the status register.
+		static void StartErasePage(std::uint32_t pageAddress);
+		static std::uint32_t FinishErasePage();
+		[[nodiscard]] static bool Busy() { return ufsel::bit::all_set(FLASH->SR, FLASH_SR_BSY); }
 		static void ClearProgrammingErrors();
+		// Waits for the end of the flash operation in progress, clears its errors and returns the status register it finished with
+		static std::uint32_t FinishOperation();
 
 		static WriteStatus Write(std::uint32_t address, nativeType data);
 
+		constexpr static std::size_t rowSize = flash_row_size;
+		using Row = std::array<nativeType, rowSize / sizeof(nativeType)>;
+		static_assert(smallestPageSize % rowSize == 0, "Flash rows must not cross page boundaries.");
+
+		// Programs a whole erased row of flash (using the fast programming where available)
+		static WriteStatus WriteRow(std::uint32_t address, Row const& data);
+
+	private:
+		// Status register of the operation preceding the erase in progress (reported by FinishErasePage)
+		static inline std::uint32_t pendingErrors_ = 0;
+
+		static WriteStatus WriteRowNatively(std::uint32_t address, Row const& data);
+
+		// Row being assembled in RAM. Full rows are committed at once, partially filled ones word by word
+		static inline Row row_;
+		static inline std::uint32_t rowAddress_ = 0;
+		static inline std::bitset<std::tuple_size_v<Row>> rowFilled_;
+
+	public:
+		// Places the data into the row being assembled. Commits the previous row, if the data belongs to another one
+		static WriteStatus AssembleWrite(std::uint32_t const address, nativeType const data) {
+			std::uint32_t const row_address = address & ~(rowSize - 1);
+			if (rowFilled_.any() && row_address != rowAddress_)
+				if (WriteStatus const status = CommitRow(); status != WriteStatus::Ok)
+					return status;
+
+			std::size_t const index = (address - row_address) / sizeof(nativeType);
+			rowAddress_ = row_address;
+			row_[index] = data;
+			rowFilled_.set(index);
+			return rowFilled_.all() ? CommitRow() : WriteStatus::Ok;
+		}
+
+		// Writes the assembled data to flash
+		static WriteStatus CommitRow() {
+			if (rowFilled_.none())
+				return WriteStatus::Ok;
+
+			WriteStatus status = WriteStatus::Ok;
+			if (rowFilled_.all())
+				status = WriteRow(rowAddress_, row_);
+			else
+				for (std::size_t index = 0; index < size(row_) && status == WriteStatus::Ok; ++index)
+					if (rowFilled_[index])
+						status = Write(rowAddress_ + index * sizeof(nativeType), row_[index]);
+
+			rowFilled_.reset();
+			// Writes don't need to wait for the end of programming. Make sure the last one of the row succeeded
+			if (std::uint32_t const SR = FinishOperation(); status == WriteStatus::Ok && !is_SR_ok(SR))
+				status = WriteStatus::OtherError;
+			return status;
+		}
+
+		// Lowest address of data that has been scheduled, but not programmed yet (buffered or assembled in a row)
+		[[nodiscard]] static std::optional<std::uint32_t> firstPendingWrite() {
+			if (rowFilled_.any())
+				return rowAddress_ + std::countr_zero(rowFilled_.to_ullong()) * sizeof(nativeType);
+			return writeBuffer_.first_address();
+		}
+
+		// Forgets the row being assembled without writing it (e.g. when the transaction is aborted)
+		static void DiscardRow() { rowFilled_.reset(); }
+
 	public:
 		template<WriteableIntegral T>
 		static bool ScheduleBufferedWrite(std::uint32_t address, T data, std::size_t length = sizeof(T)) {
@@ -151,37 +176,22 @@ namespace boot {
 		}
 
 		static WriteStatus tryPerformingBufferedWrite() {
-			if (writeBuffer_.empty())
+			if (writeBuffer_.size() == 0)
 				return WriteStatus::InsufficientData;
-			auto const shift_data = [](std::uint64_t data, std::size_t width, std::size_t shift) {
-				return (data & ufsel::bit::bitmask_of_width(width * 8)) << (shift * 8);
-			};
-
-			auto prev_record = writeBuffer_.peek(0);
-			std::uint32_t const address = prev_record.address_;
-			std::size_t num_bytes_to_write = prev_record.size_;
-			nativeType data_to_write = shift_data(prev_record.data_, prev_record.size_, 0);
-
-			std::size_t records_consumed = 1;
-			for (; num_bytes_to_write < sizeof(nativeType) && records_consumed < writeBuffer_.size(); ++records_consumed) {
-				auto const record = writeBuffer_.peek(records_consumed);
-				data_to_write |= shift_data(record.data_, record.size_, num_bytes_to_write);
-				num_bytes_to_write += record.size_;
-
-				assert(record.address_ == prev_record.address_ + prev_record.size_); // records must be contiguous
-				prev_record = record;
-			}
-			assert(num_bytes_to_write <= sizeof(nativeType));
-			if (num_bytes_to_write < sizeof(nativeType))
-				return WriteStatus::InsufficientData;
-			else { // we can perform the write!
-				writeBuffer_.pop(records_consumed);
-				return Write(address, data_to_write);
-			}
+
+			auto const [address, data] = writeBuffer_.front();
+			writeBuffer_.pop();
+			return AssembleWrite(address, data);
 		}
 
 		[[nodiscard]]
 		static bool writeBufferIsEmpty() { return writeBuffer_.empty(); }
+		// Forgets all scheduled writes including the partially accumulated native word
+		static void DiscardBufferedWrites() { writeBuffer_.reset(); }
+		// Number of further writes that can be scheduled
+		static std::size_t writeBufferFreeSpace() { return writeBuffer_.free_space(); }
+		// Number of write buffer slots occupied by a single 32 bit word
+		constexpr static std::size_t writeBufferSlotsPerWord = std::max(std::size_t{1}, sizeof(std::uint32_t) / sizeof(nativeType));
 
 		static bool isApplicationAddress(std::uint32_t address) {
 			return addressOrigin(address) == AddressSpace::ApplicationFlash;
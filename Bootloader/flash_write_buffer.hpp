@@ -0,0 +1,100 @@
+/*
+ * eForce CAN Bootloader
+ *
+ * Written by Vojtech Michal
+ *
+ * Copyright (c) 2020, 2021 eforce FEE Prague Formula
+ */
+
+#pragma once
+
+#include <ufsel/bit.hpp>
+#include <ufsel/assert.hpp>
+#include <ufsel/traits.hpp>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+namespace boot {
+
+	template<typename T>
+	concept WriteableIntegral = ufsel::traits::type_is_one_of_v<T, std::uint16_t, std::uint32_t, std::uint64_t>;
+
+	// Queue of native words waiting to be programmed. Smaller writes are merged into the native word being
+	// accumulated in place; it is queued once complete. Both pushing and popping take constant time.
+	template<WriteableIntegral Native, std::size_t CAPACITY>
+	struct FlashWriteBuffer {
+		struct record {
+			std::uint32_t address_;
+			Native data_;
+		};
+
+		constexpr static std::size_t capacity = CAPACITY;
+
+	private:
+		std::array<record, capacity> buffer_;
+		std::size_t head_ = 0, size_ = 0;
+
+		record partial_; // Native word being accumulated from smaller writes
+		std::size_t partial_bytes_ = 0;
+
+	public:
+		void reset() {
+			head_ = size_ = 0;
+			partial_bytes_ = 0;
+		}
+
+		void push(std::uint32_t address, WriteableIntegral auto data, std::size_t const length) {
+			assert(!is_full());
+			assert(length <= sizeof(Native));
+			Native const bits = static_cast<Native>(data) & ufsel::bit::bitmask_of_width<Native>(length * 8);
+
+			if (partial_bytes_ == 0) {
+				assert(address % sizeof(Native) == 0 && "Native word must be written from its beginning.");
+				partial_ = record{.address_ = address, .data_ = bits};
+			}
+			else {
+				assert(address == partial_.address_ + partial_bytes_); // writes must be contiguous
+				partial_.data_ |= bits << (partial_bytes_ * 8);
+			}
+
+			partial_bytes_ += length;
+			assert(partial_bytes_ <= sizeof(Native));
+			if (partial_bytes_ == sizeof(Native)) {
+				buffer_[(head_ + size_++) % capacity] = partial_;
+				partial_bytes_ = 0;
+			}
+		}
+
+		[[nodiscard]]
+		record const& front() const {
+			assert(size_ > 0);
+			return buffer_[head_];
+		}
+
+		void pop() {
+			assert(size_ > 0);
+			head_ = (head_ + 1) % capacity;
+			--size_;
+		}
+
+		// Lowest address, that has been pushed but not popped yet
+		[[nodiscard]] std::optional<std::uint32_t> first_address() const {
+			if (size_ > 0)
+				return buffer_[head_].address_;
+			if (partial_bytes_ > 0)
+				return partial_.address_;
+			return std::nullopt;
+		}
+
+		// Number of complete native words
+		[[nodiscard]] std::size_t size() const { return size_; }
+		// Push is possible as long as there is a slot for the word it may complete
+		[[nodiscard]] bool is_full() const { return size_ == capacity; }
+		[[nodiscard]] std::size_t free_space() const { return capacity - size_; }
+		[[nodiscard]] bool empty() const { return size_ == 0 && partial_bytes_ == 0; }
+	};
+
+}
@@ -77,6 +77,30 @@ namespace boot {
 #endif
 		}
 
+		// Common reaction to the result of writing data received in Bootloader::Data (classic or CAN FD)
+		int handleWriteStatus(WriteStatus const ret) {
+			switch (ret) {
+				case WriteStatus::Ok:
+				case WriteStatus::InsufficientData:
+				case WriteStatus::AlreadyWritten: // Allow "rewrites" of locations we have already written to
+				case WriteStatus::Staged: // Lost words preceding this one are requested by the bootloader's update
+					return 0;
+				case WriteStatus::DiscontinuousWriteAccess:
+				case WriteStatus::NotInFlash:
+					// Too far ahead of the expected location, fall back to restart of transmission (rate limited by bootloader's update)
+					assert(bootloader.expectedWriteLocation().has_value());
+					bootloader.request_data_restart();
+					return 1;
+
+				default:
+					//TODO kill the transaction for now
+					canManager.SendHandshake(handshake::abort(AbortCode::FlashWrite, static_cast<int>(ret)));
+					return 2;
+			}
+
+			assert_unreachable();
+		}
+
 		void setupRegularCanCallbacks() {
 
 			Bootloader_ExitReq_on_receive([](Bootloader_ExitReq_t* data) {
@@ -111,7 +135,8 @@ namespace boot {
 				Register const reg = static_cast<Register>(data->Register);
 				auto const response = bootloader.processHandshake(reg, static_cast<Command>(data->Command), data->Value);
 
-				canManager.SendHandshakeAck(reg, response, data->Value);
+				if (!bootloader.handshakeAckPostponed())
+					canManager.SendHandshakeAck(reg, response, data->Value);
 				return 0;
 				});
 
@@ -144,32 +169,29 @@ namespace boot {
 
 				lastReceivedData = Timestamp::Now();
 				WriteStatus volatile ret = bootloader.write(address, data->Word);
+				return handleWriteStatus(ret);
+				});
 
-				switch (ret) {
-					case WriteStatus::Ok:
-					case WriteStatus::InsufficientData:
-					case WriteStatus::AlreadyWritten: // Allow "rewrites" of locations we have already written to
-						return 0;
-					case WriteStatus::DiscontinuousWriteAccess:
-					case WriteStatus::NotInFlash: {
-						auto const expectedWriteLocation = bootloader.expectedWriteLocation();
-						assert(expectedWriteLocation.has_value());
-						if (static SysTickTimer t; t.RestartIfTimeElapsed(10_ms))
-							canManager.RestartDataFrom(*expectedWriteLocation);
-						return 1;
-					}
-
-					default:
-						//TODO kill the transaction for now
-						canManager.SendHandshake(handshake::abort(AbortCode::FlashWrite, static_cast<int>(ret)));
-						return 2;
-				}
+			// CAN FD Data frames carrying up to 15 words. Never received on bxCAN targets
+			canManager.BulkData_on_receive([](BulkData const* data) -> int {
+				if (!bootloader.transactionInProgress())
+					return 2; //The transaction has not started yet, this Data is not for us.
 
-				assert_unreachable();
+				lastReceivedData = Timestamp::Now();
+				return handleWriteStatus(bootloader.write(data->address, data->data()));
+				});
+
+			// Addressless data of the open data stream
+			canManager.StreamData_on_receive([](StreamData const* data) -> int {
+				if (!bootloader.transactionInProgress())
+					return 2; //The transaction has not started yet, this Data is not for us.
+
+				lastReceivedData = Timestamp::Now();
+				return handleWriteStatus(bootloader.write_stream(data->sequence, data->data()));
 				});
 
 			Bootloader_DataAck_on_receive([](Bootloader_DataAck_t* data) -> int {
-				bool const result = bootloader.processDataAck(data->Result);
+				bool const result = bootloader.processDataAck(data->Address << 2, data->Result, data->Credit);
 				if (!result)
 					canManager.SendHandshake(handshake::abort(AbortCode::VeryUnexpectedDataAck, 0));
 				return 0;
@@ -181,7 +203,7 @@ namespace boot {
 					return 2;
 				// TODO Do not respond to pings for now, only send beacon and software build
 				canManager.SendSoftwareBuild();
-				canManager.SendBeacon(bootloader.stalled() ? Status::ComunicationStalled: bootloader.status(), bootloader.entryReason());
+				canManager.SendBeacon(bootloader.status(), bootloader.entryReason());
 
 				return 0;
 
@@ -226,7 +248,7 @@ namespace boot {
 			if (need_to_send<Bootloader_SoftwareBuild_t>())
 				canManager.SendSoftwareBuild();
 			if (need_to_send<Bootloader_Beacon_t>())
-				canManager.SendBeacon(bootloader.stalled() ? Status::ComunicationStalled: bootloader.status(), bootloader.entryReason());
+				canManager.SendBeacon(bootloader.status(), bootloader.entryReason());
 			txProcess();
 			process_all_tx_fifos();
 
@@ -240,23 +262,16 @@ namespace boot {
 			}
 
 
+			// The master stays silent while it has no credit, hence the idle time counts only while some credit is outstanding
+			if (lastReceivedData.has_value() && !bootloader.creditOutstanding())
+				lastReceivedData = Timestamp::Now();
 			bool const some_data_received_long_time_ago = lastReceivedData.has_value() && lastReceivedData->TimeElapsed(1_s);
-			if (auto const expectedAddress = bootloader.expectedWriteLocation(); expectedAddress.has_value() && some_data_received_long_time_ago && !bootloader.stalled()) {
+			if (auto const expectedAddress = bootloader.expectedWriteLocation(); expectedAddress.has_value() && some_data_received_long_time_ago) {
 				if (static SysTickTimer lastRequest; lastRequest.RestartIfTimeElapsed(10_ms)) { //limit the frequency of requests
 					canManager.RestartDataFrom(*expectedAddress);
 				}
 			}
 
-			if (txBufferGettingFull() && !bootloader.stalled()) {
-				canManager.SendHandshake(handshake::stall);
-				bootloader.stalled() = true;
-			}
-
-			if (bootloader.stalled() && txBufferGettingEmpty()) {
-				canManager.SendHandshake(handshake::resume);
-				bootloader.stalled() = false;
-			}
-
 			canManager.update();
 
 			bootloader.update();
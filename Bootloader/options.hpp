@@ -330,10 +330,11 @@ namespace boot {
 	constexpr std::uint32_t isrVectorAlignmentMask = ufsel::bit::bitmask_of_width(customization::isrVectorAlignmentBits);
 
 	constexpr std::uint32_t smallestPageSize = (*std::min_element(physicalMemoryBlocks.begin(), physicalMemoryBlocks.end(),[](auto const &a, auto const &b) {return a.length < b.length;} )).length;
-	constexpr static std::size_t flash_write_buffer_size = 1024;
-
-	// Prevents the FirmwareUploader from flooding the tx buffer
-	constexpr static int max_tx_buffer_fill_by_data = (16 + 8) * 5;
+	// Number of native words the flash write buffer can hold
+	constexpr static std::size_t flash_write_buffer_size = 256;
+	// Granularity of flash programming. Data are assembled in RAM and committed by whole rows
+	// (row of 32 double words programmed at once by the fast programming of STM32G4)
+	constexpr static std::size_t flash_row_size = 256;
 }
 
 
@@ -0,0 +1,123 @@
+/*
+ * eForce CAN Bootloader
+ *
+ * Written by Vojtěch Michal
+ *
+ * Copyright (c) 2020 eforce FEE Prague Formula
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+
+namespace boot {
+
+	// SHA-256 (FIPS 180-4) computed in software, none of the supported MCUs has a hash unit.
+	// Data are fed by 32 bit words as read from memory, i.e. the digest is that of the bytes in the order of their addresses.
+	class Sha256 {
+	public:
+		using Digest = std::array<std::uint32_t, 8>;
+
+		void reset() {
+			state_ = initial_state;
+			block_words_ = 0;
+			total_words_ = 0;
+		}
+
+		void update(std::uint32_t const word) {
+			// Memory is little endian, SHA-256 processes big endian words
+			block_[block_words_++] = byteswap(word);
+			++total_words_;
+			if (block_words_ == block_.size()) {
+				compress();
+				block_words_ = 0;
+			}
+		}
+
+		// Pads the message and returns the digest words H0 to H7. The hash has to be reset before next use
+		[[nodiscard]] Digest finish() {
+			std::uint64_t const length_bits = total_words_ * 32;
+			block_[block_words_++] = 0x8000'0000;
+			if (block_words_ > block_.size() - 2) {
+				std::fill(block_.begin() + block_words_, block_.end(), 0);
+				compress();
+				block_words_ = 0;
+			}
+			std::fill(block_.begin() + block_words_, block_.end() - 2, 0);
+			block_[14] = length_bits >> 32;
+			block_[15] = static_cast<std::uint32_t>(length_bits);
+			compress();
+			return state_;
+		}
+
+	private:
+		constexpr static Digest initial_state {
+			0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+		};
+
+		constexpr static std::array<std::uint32_t, 64> round_constants {
+			0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+			0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+			0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+			0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+			0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+			0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+			0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+			0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+		};
+
+		Digest state_ = initial_state;
+		std::array<std::uint32_t, 16> block_{};
+		std::size_t block_words_ = 0;
+		std::uint64_t total_words_ = 0;
+
+		static std::uint32_t byteswap(std::uint32_t const word) {
+			return word >> 24 | (word >> 8 & 0xff00) | (word << 8 & 0xff'0000) | word << 24;
+		}
+
+		void compress() {
+			// The message schedule is kept in a sliding window of 16 words to save stack
+			std::array<std::uint32_t, 16> w = block_;
+			auto [a, b, c, d, e, f, g, h] = state_;
+
+			for (std::size_t round = 0; round < round_constants.size(); ++round) {
+				if (round >= w.size()) {
+					std::uint32_t const w15 = w[(round - 15) % 16], w2 = w[(round - 2) % 16];
+					std::uint32_t const s0 = std::rotr(w15, 7) ^ std::rotr(w15, 18) ^ (w15 >> 3);
+					std::uint32_t const s1 = std::rotr(w2, 17) ^ std::rotr(w2, 19) ^ (w2 >> 10);
+					w[round % 16] += s0 + w[(round - 7) % 16] + s1;
+				}
+
+				std::uint32_t const S1 = std::rotr(e, 6) ^ std::rotr(e, 11) ^ std::rotr(e, 25);
+				std::uint32_t const ch = (e & f) ^ (~e & g);
+				std::uint32_t const t1 = h + S1 + ch + round_constants[round] + w[round % 16];
+				std::uint32_t const S0 = std::rotr(a, 2) ^ std::rotr(a, 13) ^ std::rotr(a, 22);
+				std::uint32_t const maj = (a & b) ^ (a & c) ^ (b & c);
+				std::uint32_t const t2 = S0 + maj;
+
+				h = g;
+				g = f;
+				f = e;
+				e = d + t1;
+				d = c;
+				c = b;
+				b = a;
+				a = t1 + t2;
+			}
+
+			state_[0] += a;
+			state_[1] += b;
+			state_[2] += c;
+			state_[3] += d;
+			state_[4] += e;
+			state_[5] += f;
+			state_[6] += g;
+			state_[7] += h;
+		}
+	};
+
+}
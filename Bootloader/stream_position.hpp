@@ -0,0 +1,41 @@
+/*
+ * eForce CAN Bootloader
+ *
+ * Written by Vojtech Michal
+ *
+ * Copyright (c) 2020, 2021 eforce FEE Prague Formula
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+
+namespace boot {
+
+	// Number of words preceding the given address in the stream of words, that starts at the given offset into the first
+	// of the blocks and continues through the remaining blocks in order. Only the first `limit` words are searched.
+	// Empty if the address does not belong to the searched part of the stream (gap between blocks, past the last block).
+	template<typename Block>
+	std::optional<std::size_t> stream_position(std::span<Block const> const blocks, std::uint32_t offset,
+			std::uint32_t const address, std::size_t const limit) {
+		std::size_t position = 0;
+		bool found = false;
+		for (std::size_t index = 0; index < size(blocks) && position < limit; ++index, offset = 0) {
+			Block const& block = blocks[index];
+			if (address >= block.address + offset && address < block.address + block.length) {
+				position += (address - block.address - offset) / sizeof(std::uint32_t);
+				found = true;
+				break;
+			}
+			position += (block.length - offset) / sizeof(std::uint32_t);
+		}
+
+		if (!found || position >= limit)
+			return std::nullopt;
+		return position;
+	}
+
+}
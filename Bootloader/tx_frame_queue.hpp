@@ -0,0 +1,54 @@
+/*
+ * eForce CAN Bootloader
+ *
+ * Written by Vojtech Michal
+ *
+ * Copyright (c) 2020, 2021 eforce FEE Prague Formula
+ */
+
+#pragma once
+
+#include <ufsel/assert.hpp>
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+
+namespace boot {
+
+	// Queue of frames waiting for a free mailbox. Each slot holds a whole frame (identifier, length and the payload
+	// as words), frames are constructed directly in their slots and handed to the peripheral from them.
+	// Single producer and single consumer may run in different contexts (thread / interrupt) - each of the
+	// free running counters is written by one side only. Capacity must be a power of two for the counters to wrap.
+	template<typename Frame, std::size_t CAPACITY>
+	class TxFrameQueue {
+		static_assert(std::has_single_bit(CAPACITY));
+
+		std::array<Frame, CAPACITY> slots_{};
+		std::atomic<std::uint32_t> pushed_ = 0, popped_ = 0;
+
+	public:
+		constexpr static std::size_t capacity = CAPACITY;
+
+		[[nodiscard]] std::size_t size() const { return pushed_.load(std::memory_order_acquire) - popped_.load(std::memory_order_acquire); }
+		[[nodiscard]] bool empty() const { return size() == 0; }
+		[[nodiscard]] std::size_t free_space() const { return capacity - size(); }
+
+		// Slot for the next frame. It becomes visible to the consumer once pushed
+		[[nodiscard]] Frame & back() {
+			assert(free_space() > 0);
+			return slots_[pushed_.load(std::memory_order_relaxed) % capacity];
+		}
+		void push() { pushed_.store(pushed_.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+		// The index-th oldest queued frame
+		[[nodiscard]] Frame const& at(std::size_t const index) const {
+			assert(index < size());
+			return slots_[(popped_.load(std::memory_order_relaxed) + index) % capacity];
+		}
+		void pop(std::size_t const count = 1) { popped_.store(popped_.load(std::memory_order_relaxed) + count, std::memory_order_release); }
+	};
+
+}
@@ -143,7 +143,7 @@ bool Bootloader_decode_HandshakeAck_s(const uint8_t* bytes, size_t length, Bootl
 
     data_out->Register = (enum Bootloader_Register) ((bytes[0] & 0x0F));
     data_out->Target = (enum Bootloader_BootTarget) (((bytes[0] >> 4) & 0x0F));
-    data_out->Response = (enum Bootloader_HandshakeResponse) ((bytes[1] & 0x1F));
+    data_out->Response = (enum Bootloader_HandshakeResponse) ((bytes[1] & 0x3F));
     data_out->Value = bytes[2] | bytes[3] << 8 | bytes[4] << 16 | bytes[5] << 24;
     return true;
 }
@@ -154,7 +154,7 @@ bool Bootloader_decode_HandshakeAck(const uint8_t* bytes, size_t length, enum Bo
 
     *Register_out = (enum Bootloader_Register) ((bytes[0] & 0x0F));
     *Target_out = (enum Bootloader_BootTarget) (((bytes[0] >> 4) & 0x0F));
-    *Response_out = (enum Bootloader_HandshakeResponse) ((bytes[1] & 0x1F));
+    *Response_out = (enum Bootloader_HandshakeResponse) ((bytes[1] & 0x3F));
     *Value_out = bytes[2] | bytes[3] << 8 | bytes[4] << 16 | bytes[5] << 24;
     return true;
 }
@@ -178,7 +178,7 @@ uint32_t Bootloader_HandshakeAck_get_flags(void) {
 int Bootloader_send_HandshakeAck_s(const Bootloader_HandshakeAck_t* data) {
     uint8_t buffer[6];
     buffer[0] = (data->Register & 0x0F) | ((data->Target & 0x0F) << 4);
-    buffer[1] = (data->Response & 0x1F);
+    buffer[1] = (data->Response & 0x3F);
     buffer[2] = data->Value;
     buffer[3] = (data->Value >> 8);
     buffer[4] = (data->Value >> 16);
@@ -190,7 +190,7 @@ int Bootloader_send_HandshakeAck_s(const Bootloader_HandshakeAck_t* data) {
 int Bootloader_send_HandshakeAck(enum Bootloader_Register Register, enum Bootloader_BootTarget Target, enum Bootloader_HandshakeResponse Response, uint32_t Value) {
     uint8_t buffer[6];
     buffer[0] = (Register & 0x0F) | ((Target & 0x0F) << 4);
-    buffer[1] = (Response & 0x1F);
+    buffer[1] = (Response & 0x3F);
     buffer[2] = Value;
     buffer[3] = (Value >> 8);
     buffer[4] = (Value >> 16);
@@ -356,20 +356,22 @@ candb_bus_t Bootloader_Data_get_tx_bus(void) {
 }
 
 bool Bootloader_decode_DataAck_s(const uint8_t* bytes, size_t length, Bootloader_DataAck_t* data_out) {
-    if (length != 4)
+    if (length != 4 && length != 6)
         return false;
 
     data_out->Address = bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (bytes[3] & 0x3F) << 24;
     data_out->Result = (enum Bootloader_WriteResult) (((bytes[3] >> 6) & 0x03));
+    data_out->Credit = length == 6 ? bytes[4] | bytes[5] << 8 : 0;
     return true;
 }
 
-bool Bootloader_decode_DataAck(const uint8_t* bytes, size_t length, uint32_t* Address_out, enum Bootloader_WriteResult* Result_out) {
-    if (length != 4)
+bool Bootloader_decode_DataAck(const uint8_t* bytes, size_t length, uint32_t* Address_out, enum Bootloader_WriteResult* Result_out, uint16_t* Credit_out) {
+    if (length != 4 && length != 6)
         return false;
 
     *Address_out = bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (bytes[3] & 0x3F) << 24;
     *Result_out = (enum Bootloader_WriteResult) (((bytes[3] >> 6) & 0x03));
+    *Credit_out = length == 6 ? bytes[4] | bytes[5] << 8 : 0;
     return true;
 }
 
@@ -390,21 +392,25 @@ uint32_t Bootloader_DataAck_get_flags(void) {
 }
 
 int Bootloader_send_DataAck_s(const Bootloader_DataAck_t* data) {
-    uint8_t buffer[4];
+    uint8_t buffer[6];
     buffer[0] = data->Address;
     buffer[1] = (data->Address >> 8);
     buffer[2] = (data->Address >> 16);
     buffer[3] = ((data->Address >> 24) & 0x3F) | ((data->Result & 0x03) << 6);
+    buffer[4] = data->Credit;
+    buffer[5] = (data->Credit >> 8);
     int rc = txSendCANMessage(Bootloader_Handshake_get_rx_bus(), Bootloader_DataAck_id, buffer, sizeof(buffer));
     return rc;
 }
 
-int Bootloader_send_DataAck(uint32_t Address, enum Bootloader_WriteResult Result) {
-    uint8_t buffer[4];
+int Bootloader_send_DataAck(uint32_t Address, enum Bootloader_WriteResult Result, uint16_t Credit) {
+    uint8_t buffer[6];
     buffer[0] = Address;
     buffer[1] = (Address >> 8);
     buffer[2] = (Address >> 16);
     buffer[3] = ((Address >> 24) & 0x3F) | ((Result & 0x03) << 6);
+    buffer[4] = Credit;
+    buffer[5] = (Credit >> 8);
     int rc = txSendCANMessage(Bootloader_Handshake_get_rx_bus(), Bootloader_DataAck_id, buffer, sizeof(buffer));
     return rc;
 }
@@ -102,6 +102,18 @@ enum Bootloader_Command {
     Bootloader_Command_StartFirmwareReadout = 8,
     /* Sent by the master to request dump (readout) of the flashed bootloader code. */
     Bootloader_Command_StartBootloaderReadout = 9,
+    /* Sent by the master during firmware download to open data stream at given address. Following data is sent without addresses. */
+    Bootloader_Command_OpenDataStream = 10,
+    /* Sent by the bootloader to request retransmission of a single lost word at given address. Words following it have already been received. */
+    Bootloader_Command_RetransmitWord = 11,
+    /* Sent by the master during firmware download to open data stream carrying compressed data at given address. */
+    Bootloader_Command_OpenCompressedDataStream = 12,
+    /* Sent by the master during delta update to copy data from the old firmware (address given by preceding Argument) to the expected location. Value is the number of bytes. */
+    Bootloader_Command_CopyFromOldFirmware = 13,
+    /* Sent by the master during firmware download to skip erased data (all ones) up to given address within the current logical block. */
+    Bootloader_Command_SkipErasedData = 14,
+    /* Sent by the master during firmware download to write the word given by preceding Argument repeatedly to the expected location. Value is the number of words. */
+    Bootloader_Command_Fill = 15,
 };
 
 enum Bootloader_EntryReason {
@@ -192,6 +204,12 @@ enum Bootloader_HandshakeResponse {
     Bootloader_HandshakeResponse_PageEraseFailed = 28,
     /* Failed to transfer buffered new bootloader code from RAM to Flash */
     Bootloader_HandshakeResponse_BufferTransferFailed = 29,
+    /* Source of the copy operation does not lie within the old firmware or has already been overwritten. */
+    Bootloader_HandshakeResponse_PatchSourceInvalid = 30,
+    /* Digest of the page matches the new content. The page was not erased and its range is skipped by the download. */
+    Bootloader_HandshakeResponse_PageUnchanged = 31,
+    /* Checksum of the last block matches, but some of the preceding blocks are corrupted and have to be repaired. */
+    Bootloader_HandshakeResponse_BlocksPendingRepair = 32,
 };
 
 enum Bootloader_Register {
@@ -223,6 +241,8 @@ enum Bootloader_Register {
     Bootloader_Register_PhysicalBlockLength = 12,
     /* Use the Command field in message Handshake to determine the requested task */
     Bootloader_Register_Command = 13,
+    /* Operand of the following command. Up to two arguments are collected and discarded once the command is processed. */
+    Bootloader_Register_Argument = 14,
 };
 
 enum Bootloader_State {
@@ -336,6 +356,9 @@ typedef struct Bootloader_DataAck_t {
 
 	/* Identifies the result of previous write operation. */
 	enum Bootloader_WriteResult	Result;
+
+	/* Number of words the sender of Data may transmit beyond Address before waiting for next acknowledgement. */
+	uint16_t	Credit;
 } Bootloader_DataAck_t;
 
 #define Bootloader_DataAck_Address_OFFSET	((float)0)
@@ -491,14 +514,14 @@ int Bootloader_send_Data(uint32_t Address, uint32_t Word);
 candb_bus_t Bootloader_Data_get_tx_bus(void);
 
 bool Bootloader_decode_DataAck_s(const uint8_t* bytes, size_t length, Bootloader_DataAck_t* data_out);
-bool Bootloader_decode_DataAck(const uint8_t* bytes, size_t length, uint32_t* Address_out, enum Bootloader_WriteResult* Result_out);
+bool Bootloader_decode_DataAck(const uint8_t* bytes, size_t length, uint32_t* Address_out, enum Bootloader_WriteResult* Result_out, uint16_t* Credit_out);
 int Bootloader_send_DataAck_s(const Bootloader_DataAck_t* data);
 uint32_t Bootloader_get_DataAck(Bootloader_DataAck_t* data_out);
 uint32_t Bootloader_DataAck_get_flags(void);
 void Bootloader_DataAck_on_receive(int (*callback)(Bootloader_DataAck_t* data));
 candb_bus_t Bootloader_DataAck_get_rx_bus(void);
 bool Bootloader_DataAck_ever_received(void);
-int Bootloader_send_DataAck(uint32_t Address, enum Bootloader_WriteResult Result);
+int Bootloader_send_DataAck(uint32_t Address, enum Bootloader_WriteResult Result, uint16_t Credit);
 candb_bus_t Bootloader_DataAck_get_tx_bus(void);
 
 bool Bootloader_decode_ExitReq_s(const uint8_t* bytes, size_t length, Bootloader_ExitReq_t* data_out);
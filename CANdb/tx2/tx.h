@@ -36,8 +36,7 @@ typedef enum {
 
 int txReceiveCANMessage(int bus, CAN_ID_t id, const void* data, size_t length);
 void txProcess(void);
-bool txBufferGettingFull();
-bool txBufferGettingEmpty();
+size_t txRecvBufferFreeSpace();
 
 
 /* implemented by library user */
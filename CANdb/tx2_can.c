@@ -7,18 +7,14 @@
 #ifndef TX_RECV_BUFFER_SIZE
 enum { TX_RECV_BUFFER_SIZE = 1024 };
 #endif
+#ifndef TX_MAX_MESSAGE_SIZE
+// Largest payload accepted by txReceiveCANMessage. Targets receiving CAN FD frames shall raise it to 64
+enum { TX_MAX_MESSAGE_SIZE = CAN_MESSAGE_SIZE };
+#endif
 #ifndef TX_MAX_MSGS_PROCESSED_IN_A_ROW
 enum { TX_MAX_MSGS_PROCESSED_IN_A_ROW = 16 };
 #endif
 
-#ifndef TX_RECV_BUFFER_FULL_THRESHOLD
-enum { TX_RECV_BUFFER_FULL_THRESHOLD = TX_RECV_BUFFER_SIZE / 4 };
-#endif
-
-#ifndef TX_RECV_BUFFER_EMPTY_THRESHOLD
-enum { TX_RECV_BUFFER_EMPTY_THRESHOLD = 3 * TX_RECV_BUFFER_SIZE / 4 };
-#endif
-
 static uint8_t recv_buf[TX_RECV_BUFFER_SIZE];
 static ringbuf_t recv_rb = {.data = recv_buf, .size = TX_RECV_BUFFER_SIZE, .readpos = 0, .writepos = 0};
 
@@ -35,6 +31,14 @@ extern void candbHandleMessage(int bus, uint32_t timestamp, CAN_ID_t id, const u
 int txReceiveCANMessage(int bus, CAN_ID_t id, const void* data, size_t length) {
 	const size_t required_size = sizeof(struct CAN_msg_header) + length;
 
+	if (length > TX_MAX_MESSAGE_SIZE) {
+		tx_irq_error.error_flags = TX_LENGTH_MISMATCH;
+		tx_irq_error.bus = bus;
+		tx_irq_error.id = id;
+		tx_irq_error.length = length;
+		return -TX_LENGTH_MISMATCH;
+	}
+
 	if (!ringbufCanWrite(&recv_rb, required_size)) {
 		tx_irq_error.error_flags = TX_RECV_BUFFER_OVERFLOW;
 		tx_irq_error.bus = bus;
@@ -50,16 +54,13 @@ int txReceiveCANMessage(int bus, CAN_ID_t id, const void* data, size_t length) {
 	return required_size;
 }
 
-bool txBufferGettingFull() {
-	return !ringbufCanWrite(&recv_rb, TX_RECV_BUFFER_FULL_THRESHOLD);
-}
-bool txBufferGettingEmpty() {
-	return ringbufCanWrite(&recv_rb, TX_RECV_BUFFER_EMPTY_THRESHOLD);
+size_t txRecvBufferFreeSpace() {
+	return ringbufFreeSpace(&recv_rb);
 }
 
 void txProcess(void) {
 	struct CAN_msg_header hdr;
-	uint8_t msg_data[CAN_MESSAGE_SIZE];
+	uint8_t msg_data[TX_MAX_MESSAGE_SIZE];
 
 	// As long as there is pending data in the rx buffer, but do not allow more than some specified number
 	for (int i = 0;i < TX_MAX_MSGS_PROCESSED_IN_A_ROW;++i) {
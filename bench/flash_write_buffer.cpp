@@ -0,0 +1,139 @@
+/*
+ * eForce CAN Bootloader
+ *
+ * Host microbenchmark of the flash write buffer. Measures the cost of passing one native word through the buffer
+ * (scheduling its 32 bit halves and popping the assembled native word) for the legacy byte ring buffer and the
+ * current coalescing FlashWriteBuffer.
+ */
+
+#include <Bootloader/flash_write_buffer.hpp>
+#include <CANdb/tx2/ringbuf.h>
+
+#include "harness.hpp"
+
+#include <cstdint>
+
+namespace legacy {
+
+	using boot::WriteableIntegral;
+
+	// FlashWriteBuffer and Flash::tryPerformingBufferedWrite as they were before the typed ring
+	template<std::size_t CAPACITY>
+	struct FlashWriteBuffer {
+		struct record {
+			std::uint32_t address_;
+			std::uint8_t size_;
+			std::uint64_t data_;
+		};
+
+		constexpr static std::size_t capacity = CAPACITY;
+		record buffer[capacity];
+		ringbuf_t ringbuf {.data = reinterpret_cast<std::uint8_t*>(buffer), .size = CAPACITY, .readpos = 0, .writepos = 0};
+
+		void push(std::uint32_t address, WriteableIntegral auto data, std::size_t const length) {
+			assert(ringbufCanWrite(&ringbuf, sizeof(record)));
+			record const new_record {.address_ = address, .size_ = static_cast<std::uint8_t>(length), .data_ = data};
+			ringbufWrite(&ringbuf, reinterpret_cast<std::uint8_t const*>(&new_record), sizeof(record));
+		}
+
+		[[nodiscard]]
+		record peek(int offset) const {
+			assert(ringbufSize(&ringbuf) >= (offset + 1) * sizeof(record));
+
+			size_t readpos = (ringbuf.readpos + offset * sizeof(record)) % capacity;
+			record result;
+			ringbufTryRead(&ringbuf, reinterpret_cast<std::uint8_t *>(&result), sizeof(record), &readpos);
+			return result;
+		}
+
+		void pop(int count) {
+			assert(ringbufSize(&ringbuf) >= count * sizeof(record));
+			ringbuf.readpos = (ringbuf.readpos + count * sizeof(record)) % capacity;
+		}
+
+		[[nodiscard]] std::size_t size() const { return ringbufSize(&ringbuf) / sizeof(record); }
+		[[nodiscard]] bool is_full() const { return !ringbufCanWrite(&ringbuf, sizeof(record)); }
+		[[nodiscard]] bool empty() const { return size() == 0; }
+	};
+
+	template<typename Native, typename Buffer, typename Sink>
+	bool tryPerformingBufferedWrite(Buffer & writeBuffer, Sink && sink) {
+		if (writeBuffer.empty())
+			return false;
+		auto const shift_data = [](std::uint64_t data, std::size_t width, std::size_t shift) {
+			return (data & ufsel::bit::bitmask_of_width<std::uint64_t>(width * 8)) << (shift * 8);
+		};
+
+		auto prev_record = writeBuffer.peek(0);
+		std::uint32_t const address = prev_record.address_;
+		std::size_t num_bytes_to_write = prev_record.size_;
+		Native data_to_write = shift_data(prev_record.data_, prev_record.size_, 0);
+
+		std::size_t records_consumed = 1;
+		for (; num_bytes_to_write < sizeof(Native) && records_consumed < writeBuffer.size(); ++records_consumed) {
+			auto const record = writeBuffer.peek(records_consumed);
+			data_to_write |= shift_data(record.data_, record.size_, num_bytes_to_write);
+			num_bytes_to_write += record.size_;
+
+			assert(record.address_ == prev_record.address_ + prev_record.size_);
+			prev_record = record;
+		}
+		if (num_bytes_to_write < sizeof(Native))
+			return false;
+		writeBuffer.pop(records_consumed);
+		sink(address, data_to_write);
+		return true;
+	}
+}
+
+namespace {
+
+	constexpr std::size_t native_words = 1 << 22;
+	// Words scheduled before the buffer is drained (the legacy ring holds 63 records)
+	constexpr std::size_t batch = 32;
+
+	struct Sink {
+		std::uint64_t checksum = 0;
+		void operator()(std::uint32_t address, std::uint64_t data) { checksum += address ^ data; }
+	};
+
+	template<typename Native, typename Schedule, typename Drain>
+	double measure(Schedule && schedule, Drain && drain) {
+		constexpr std::size_t words_per_native = sizeof(Native) / sizeof(std::uint32_t);
+		return bench::measure(native_words, [&] {
+			std::uint32_t address = 0x0800'0000;
+			for (std::size_t done = 0; done < native_words; done += batch / words_per_native) {
+				for (std::size_t word = 0; word < batch; ++word, address += sizeof(std::uint32_t))
+					schedule(address, std::uint32_t{address * 2654435761u});
+				drain();
+			}
+		});
+	}
+
+	template<typename Native>
+	bool run(char const * name) {
+		Sink legacy_sink, current_sink;
+
+		static legacy::FlashWriteBuffer<1024> legacy_buffer;
+		double const before = measure<Native>(
+			[](std::uint32_t address, std::uint32_t data) { legacy_buffer.push(address, data, sizeof(data)); },
+			[&] { while (legacy::tryPerformingBufferedWrite<Native>(legacy_buffer, legacy_sink)); });
+
+		static boot::FlashWriteBuffer<Native, 256> buffer;
+		double const after = measure<Native>(
+			[](std::uint32_t address, std::uint32_t data) { buffer.push(address, data, sizeof(data)); },
+			[&] {
+				for (; buffer.size() != 0; buffer.pop())
+					current_sink(buffer.front().address_, buffer.front().data_);
+			});
+
+		return bench::report(name, "native word", before, after, legacy_sink.checksum, current_sink.checksum);
+	}
+}
+
+int main() {
+	return bench::exit_code({
+		run<std::uint32_t>("32 bit native (F2/F4/F7)"),
+		run<std::uint64_t>("64 bit native (G4)"),
+	});
+}
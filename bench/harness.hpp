@@ -0,0 +1,50 @@
+/*
+ * eForce CAN Bootloader
+ *
+ * Shared part of the host microbenchmarks: timing of the measured loop and the before/after report.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <initializer_list>
+
+namespace bench {
+
+	// Results of the measured code are stored here, so that the compiler cannot drop the computation
+	inline std::uint64_t volatile sink_value;
+
+	// Runs the body once and returns its duration in nanoseconds per processed item
+	template<typename Body>
+	double measure(std::size_t const items, Body && body) {
+		auto const start = std::chrono::steady_clock::now();
+		body();
+		auto const elapsed = std::chrono::steady_clock::now() - start;
+		return std::chrono::duration<double, std::nano>(elapsed).count() / items;
+	}
+
+	// Compares the results of the legacy and the current implementation and prints the cost of both per item.
+	// Returns false when the results differ.
+	inline bool report(char const * name, char const * item, double const before, double const after,
+			std::uint64_t const legacy_result, std::uint64_t const current_result) {
+		if (legacy_result != current_result) {
+			std::printf("%s: the legacy and the current implementation disagree!\n", name);
+			return false;
+		}
+		sink_value = current_result;
+		std::printf("%-26s before %7.2f ns/%s, after %7.2f ns/%s (%.1fx)\n", name, before, item, after, item, before / after);
+		return true;
+	}
+
+	// Exit code for ctest, nonzero when any of the runs failed
+	inline int exit_code(std::initializer_list<bool> const runs) {
+		for (bool const ok : runs)
+			if (!ok)
+				return 1;
+		return 0;
+	}
+
+}
@@ -0,0 +1,7 @@
+/*
+ * Host stand-in for the part of ufsel used by the benchmarked headers.
+ */
+
+#pragma once
+
+#include <cassert>
@@ -0,0 +1,17 @@
+/*
+ * Host stand-in for the part of ufsel used by the benchmarked headers.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace ufsel::bit {
+
+	template<typename T = std::uint32_t>
+	constexpr T bitmask_of_width(std::size_t const width) {
+		return width >= sizeof(T) * 8 ? ~T{0} : static_cast<T>((T{1} << width) - 1);
+	}
+
+}
@@ -0,0 +1,14 @@
+/*
+ * Host stand-in for the part of ufsel used by the benchmarked headers.
+ */
+
+#pragma once
+
+#include <type_traits>
+
+namespace ufsel::traits {
+
+	template<typename T, typename... Ts>
+	constexpr bool type_is_one_of_v = (std::is_same_v<T, Ts> || ...);
+
+}
@@ -0,0 +1,60 @@
+/*
+ * eForce CAN Bootloader
+ *
+ * Host test of the lookup of staged words within the receive window of the firmware download.
+ */
+
+#include <Bootloader/stream_position.hpp>
+
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <optional>
+#include <span>
+
+namespace {
+
+	struct Block {
+		std::uint32_t address, length;
+	};
+
+	// Two blocks of 16 words with a gap of 16 bytes in between, the stream starts at the third word of the first one
+	constexpr std::array<Block, 2> blocks {
+		Block{0x0800'4000, 0x40},
+		Block{0x0800'4050, 0x40},
+	};
+	constexpr std::uint32_t offset = 0x08;
+	constexpr std::size_t window = 64;
+
+	bool check(char const * name, std::uint32_t const address, std::optional<std::size_t> const expected, std::size_t const limit = window) {
+		auto const position = boot::stream_position(std::span<Block const>{blocks}, offset, address, limit);
+		if (position == expected)
+			return true;
+		std::printf("%s: address 0x%08x, expected %d, got %d\n", name, static_cast<unsigned>(address),
+			expected ? static_cast<int>(*expected) : -1, position ? static_cast<int>(*position) : -1);
+		return false;
+	}
+}
+
+int main() {
+	bool const results[] {
+		check("expected location", 0x0800'4008, 0),
+		check("within the first block", 0x0800'4020, 6),
+		check("last word of the first block", 0x0800'403c, 13),
+		check("start of the second block", 0x0800'4050, 14),
+		check("within the second block", 0x0800'4060, 18),
+		check("last word of the second block", 0x0800'408c, 29),
+		check("before the stream", 0x0800'4004, std::nullopt),
+		check("gap between blocks", 0x0800'4040, std::nullopt),
+		check("end of the gap", 0x0800'404c, std::nullopt),
+		check("past the end", 0x0800'4090, std::nullopt),
+		check("far past the end", 0x0801'0000, std::nullopt),
+		check("beyond the window", 0x0800'4060, std::nullopt, 18),
+		check("last word of the window", 0x0800'4060, 18, 19),
+	};
+	for (bool const ok : results)
+		if (!ok)
+			return 1;
+	std::printf("all positions correct\n");
+	return 0;
+}
@@ -0,0 +1,124 @@
+/*
+ * eForce CAN Bootloader
+ *
+ * Host microbenchmark of the CAN transmit queue. Measures the cost of queueing one frame and handing it over
+ * to a mailbox for the legacy byte ring buffer (header and payload serialized byte by byte) and the current
+ * TxFrameQueue of fixed frame slots.
+ */
+
+#include <Bootloader/tx_frame_queue.hpp>
+#include <CANdb/tx2/ringbuf.h>
+
+#include "harness.hpp"
+
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+namespace {
+
+	// Frame slots of bxCAN and FDCAN as defined by the BSP
+	template<std::size_t WORDS>
+	struct MessageData {
+		std::uint32_t id, length;
+		std::array<std::uint32_t, WORDS> data;
+	};
+
+	namespace legacy {
+
+		// txSendCANMessage and process_tx_fifo as they were before the frame queue
+		struct tx_fifo_message_header {
+			std::uint32_t id;
+			std::uint8_t length;
+		};
+		static_assert(sizeof(tx_fifo_message_header) == 8);
+
+		std::array<std::uint8_t, 1024 * 4> tx_buf;
+		ringbuf_t tx_rb {.data = tx_buf.data(), .size = tx_buf.size(), .readpos = 0, .writepos = 0};
+
+		int send(std::uint32_t const id, void const * const data, std::size_t const length) {
+			if (!ringbufCanWrite(&tx_rb, sizeof(tx_fifo_message_header) + length))
+				return 1;
+			tx_fifo_message_header const hdr{.id = id, .length = static_cast<std::uint8_t>(length)};
+			ringbufWriteUnchecked(&tx_rb, reinterpret_cast<std::uint8_t const*>(&hdr), sizeof(hdr));
+			ringbufWriteUnchecked(&tx_rb, static_cast<std::uint8_t const*>(data), length);
+			return 0;
+		}
+
+		template<typename Frame, typename Mailbox>
+		void process(Mailbox && mailbox) {
+			while (tx_rb.readpos != tx_rb.writepos) {
+				size_t read_pos = tx_rb.readpos;
+				tx_fifo_message_header hdr;
+				ringbufTryRead(&tx_rb, reinterpret_cast<std::uint8_t*>(&hdr), sizeof(hdr), &read_pos);
+				Frame message {.id = hdr.id, .length = hdr.length, .data = {}};
+				ringbufTryRead(&tx_rb, reinterpret_cast<std::uint8_t*>(message.data.data()), hdr.length, &read_pos);
+				tx_rb.readpos = read_pos;
+				mailbox(message);
+			}
+		}
+	}
+
+	constexpr std::size_t frames = 1 << 22;
+	// Frames queued before the queue is drained (fits both queues for FD frames)
+	constexpr std::size_t batch = 32;
+
+	struct Mailbox {
+		std::uint32_t checksum = 0;
+		template<typename Frame>
+		void operator()(Frame const& frame) {
+			checksum += frame.id ^ frame.length;
+			for (std::size_t i = 0; i < (frame.length + 3) / 4; ++i)
+				checksum += frame.data[i];
+		}
+	};
+
+	template<typename Send, typename Drain>
+	double measure(std::size_t const length, Send && send, Drain && drain) {
+		return bench::measure(frames, [&] {
+			std::array<std::uint32_t, 16> payload{};
+			for (std::size_t done = 0; done < frames; done += batch) {
+				for (std::size_t i = 0; i < batch; ++i) {
+					payload[0] = static_cast<std::uint32_t>(done + i);
+					if (send(0x620 + i % 8, payload.data(), length) != 0)
+						std::printf("queue overflow!\n");
+				}
+				drain();
+			}
+		});
+	}
+
+	template<std::size_t WORDS>
+	bool run(char const * name, std::size_t const length) {
+		using Frame = MessageData<WORDS>;
+		Mailbox legacy_mailbox, current_mailbox;
+
+		double const before = measure(length, legacy::send, [&] { legacy::process<Frame>(legacy_mailbox); });
+
+		static boot::TxFrameQueue<Frame, std::bit_ceil(4 * 1024 / sizeof(Frame))> queue;
+		auto const send = [](std::uint32_t const id, void const * const data, std::size_t const length) {
+			if (queue.free_space() == 0)
+				return 1;
+			Frame & frame = queue.back();
+			frame.id = id;
+			frame.length = length;
+			std::memcpy(frame.data.data(), data, length);
+			queue.push();
+			return 0;
+		};
+		double const after = measure(length, send, [&] {
+			for (; !queue.empty(); queue.pop())
+				current_mailbox(queue.at(0));
+		});
+
+		return bench::report(name, "frame", before, after, legacy_mailbox.checksum, current_mailbox.checksum);
+	}
+}
+
+int main() {
+	return bench::exit_code({
+		run<2>("classic 8 B Data (bxCAN)", 8),
+		run<16>("FD 64 B Data (FDCAN)", 64),
+	});
+}
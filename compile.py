@@ -16,6 +16,8 @@ class CAN:
 	bitrate_khz : int
 	RX : Pin
 	TX : Pin
+	# Send frames longer than 8 bytes (readout Data) as CAN FD frames. Defaults to FD on FDCAN peripherals (STM32G4)
+	fd : Optional[bool] = None
 
 @dataclasses.dataclass
 class Config:
@@ -38,7 +40,7 @@ def build_configuration(data : Config):
 		# To lift the metaprogramming burden off of BL software (where it would require horrible macros/templates), this
 		# script specifies all of:
 		#   - what peripheral is connected to the given vehicle bus
-		#   - CAN bus bitrate (for now assuming all are FD-incapable. This will introduce yet another headache later.
+		#   - CAN bus bitrate and whether CAN FD frames may be sent on the bus
 		#   - TX and RX pin
 		#   - their alternate functions
 		return f"'{pin.port}', {pin.pin}, {pin.AF if pin.AF is not None else old_design_af}" if pin is not None else 'None'
@@ -46,6 +48,11 @@ def build_configuration(data : Config):
 	can1_used = data.can1 is not None
 	can2_used = data.can2 is not None
 
+	def fd_enabled(can):
+		if can is None:
+			return False
+		return can.fd if can.fd is not None else can.peripheral.startswith('FDCAN')
+
 	args = [
 		'cmake',
 		'-GNinja',
@@ -59,6 +66,8 @@ def build_configuration(data : Config):
 		f'-DCAN2_BITRATE={data.can2.bitrate_khz if can2_used else ""}_kHz',
 		f'-DCAN1_PERIPHERAL={data.can1.peripheral if can1_used else ""}_BASE',
 		f'-DCAN2_PERIPHERAL={data.can2.peripheral if can2_used else ""}_BASE',
+		f'-DCAN1_FD={1 if fd_enabled(data.can1) else 0}',
+		f'-DCAN2_FD={1 if fd_enabled(data.can2) else 0}',
 		f'-DCAN1_RX_pin={format_pin(data.can1.RX) if can1_used else ""}',
 		f'-DCAN1_TX_pin={format_pin(data.can1.TX) if can1_used else ""}',
 		f'-DCAN2_RX_pin={format_pin(data.can2.RX) if can2_used else ""}',